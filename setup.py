@@ -34,6 +34,6 @@ setup(
     zip_safe=True,
     packages=find_packages(),
     package_data={
-        'sonavara': ['c/tokeniser.c', 'c/nfa.c', 'c/engine.c', 'c/lexer.c'],
+        'sonavara': ['c/arena.c', 'c/unicode.c', 'c/tokeniser.c', 'c/nfa.c', 'c/scan.c', 'c/engine.c', 'c/lexer.c', 'c/generator.c'],
     },
 )
@@ -0,0 +1,67 @@
+#ifndef SONAVARA_ARENA_INCLUDED
+#define SONAVARA_ARENA_INCLUDED
+
+#include <stdlib.h>
+
+/* A bump allocator.  Everything allocated from an arena is released together
+ * by arena_free; there is no way to free a single allocation. */
+
+#define ARENA_CHUNK 4096
+#define ARENA_ALIGN (2 * sizeof(void *))
+
+struct arena_chunk {
+    struct arena_chunk *prev;
+    size_t size;
+    size_t used;
+};
+
+struct arena {
+    struct arena_chunk *chunk;
+};
+
+static struct arena_chunk *arena_chunk(size_t size, struct arena_chunk *prev) {
+    struct arena_chunk *chunk = malloc(sizeof(*chunk) + ARENA_ALIGN + size);
+    chunk->prev = prev;
+    chunk->size = size;
+    chunk->used = 0;
+    return chunk;
+}
+
+static void *arena_alloc(struct arena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    struct arena_chunk *chunk = arena->chunk;
+
+    if (!chunk || chunk->size - chunk->used < size) {
+        if (chunk && size > ARENA_CHUNK / 2) {
+            /* Too big to be worth abandoning the rest of the current chunk
+             * for; give it a chunk of its own behind the current one. */
+            chunk->prev = arena_chunk(size, chunk->prev);
+            chunk = chunk->prev;
+        } else {
+            chunk = arena_chunk(size > ARENA_CHUNK ? size : ARENA_CHUNK, chunk);
+            arena->chunk = chunk;
+        }
+    }
+
+    char *base = (char *)(chunk + 1);
+    base += (ARENA_ALIGN - (size_t)base % ARENA_ALIGN) % ARENA_ALIGN;
+
+    void *p = base + chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+static void arena_free(struct arena *arena) {
+    struct arena_chunk *chunk = arena->chunk;
+    while (chunk) {
+        struct arena_chunk *prev = chunk->prev;
+        free(chunk);
+        chunk = prev;
+    }
+    arena->chunk = NULL;
+}
+
+#endif
+
+/* vim: set sw=4 et: */
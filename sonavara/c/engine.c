@@ -4,143 +4,1451 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if defined(SONAVARA_PARALLEL) || defined(SONAVARA_COMPILE_CACHE)
+#include <pthread.h>
+#endif
+
+#ifdef SONAVARA_STATS
+#include <time.h>
+#endif
+
 #ifndef SONAVARA_NO_SELF_CHAIN
 #include "nfa.c"
+#include "scan.c"
+#endif
+
+/* Lazily-built DFA states are cached on the regex, keyed by the set of NFA
+ * states they represent.  Once the cache holds this many states it is
+ * flushed and rebuilt on demand. */
+#ifndef SONAVARA_DFA_CACHE_STATES
+#define SONAVARA_DFA_CACHE_STATES 1024
+#endif
+
+/* If the cache fills up again before the DFA has scanned this many bytes per
+ * cached state, it's thrashing: the match is handed to the NFA simulation,
+ * which is slower but linear with no allocation. */
+#ifndef SONAVARA_DFA_MIN_BYTES_PER_STATE
+#define SONAVARA_DFA_MIN_BYTES_PER_STATE 10
+#endif
+
+/* The most NFA states, counting each iteration of a counted repetition's
+ * body separately, that a regex may have. */
+#ifndef SONAVARA_MAX_SLOTS
+#define SONAVARA_MAX_SLOTS (1 << 22)
+#endif
+
+/* With SONAVARA_PARALLEL, regex_match_many splits a batch of at least twice
+ * this many inputs across up to SONAVARA_MATCH_THREADS threads. */
+#ifndef SONAVARA_MATCH_BATCH
+#define SONAVARA_MATCH_BATCH 16384
+#endif
+
+#ifndef SONAVARA_MATCH_THREADS
+#define SONAVARA_MATCH_THREADS 4
 #endif
 
+/* How many inputs regex_match_many steps through the DFA side by side.  Each
+ * step's transition lookup depends on the last, so several inputs give the
+ * CPU independent loads to overlap when the DFA's tables miss the cache.
+ * When they don't, the extra bookkeeping costs more than that saves. */
+#ifndef SONAVARA_MATCH_LANES
+#define SONAVARA_MATCH_LANES 1
+#endif
+
+/* With SONAVARA_COMPILE_CACHE, compiling a pattern, or a set of patterns,
+ * that a live regex was compiled from shares that regex's automaton rather
+ * than building another.  Each regex still has its own working space and DFA
+ * cache, so regexes that share an automaton can match on separate threads.
+ * The cache has this many hash buckets. */
+#ifndef SONAVARA_COMPILE_CACHE_BUCKETS
+#define SONAVARA_COMPILE_CACHE_BUCKETS 256
+#endif
+
+/* With SONAVARA_STATS, each regex counts what it costs, and regex_stats
+ * reports the counts.  STATS(x) is x only then. */
+#ifdef SONAVARA_STATS
+#define STATS(x) x
+#else
+#define STATS(x)
+#endif
+
+/* Time is compile time, states the NFA states built before they're
+ * optimised, and insts and slots what's left of them.  dstates counts the
+ * DFA states built, over every flush of the cache.  peak is the most NFA
+ * states a match has had live at once, and bytes how many bytes matches have
+ * stepped through, including in the NFA once the DFA has given up. */
+struct regex_stats {
+    double compile_us;
+    int states;
+    int insts;
+    int slots;
+    unsigned long dstates;
+    unsigned long flushes;
+    unsigned long matches;
+    unsigned long nfa_matches;
+    unsigned long bytes;
+    int peak;
+};
+
+/* match is 0, or one more than the lowest-numbered rule the state accepts
+ * for.  states holds the indices of its NFA instructions, sorted.  next has
+ * one entry per byte class.  Once the state is seen to loop on itself, loop
+ * is the scan.c set of bytes it loops on. */
+struct dstate {
+    int id;
+    int match;
+    int nstates;
+    int *states;
+    unsigned char *loop;
+    struct dstate *chain;
+    struct dstate *next[];
+};
+
+struct sparse_set {
+    int n;
+    int *dense;
+    int *sparse;
+};
+
+/* The body of a counted repetition: the size instructions from the
+ * STATE_REPEAT's x up to and including its partner STATE_COUNT, held from
+ * index body of the regex's bodies.  counts is how many iteration counts are
+ * told apart: high, or low if there's no upper bound, after which further
+ * iterations are all alike. */
+struct loop {
+    int entry;
+    int low, high;
+    int counts;
+    int size;
+    int body;
+    int base;
+};
+
+struct regex_cached;
+
+/* A regex lives in its own arena, which holds everything but the DFA cache;
+ * that has an arena of its own so it can be flushed.  With
+ * SONAVARA_COMPILE_CACHE, a compiled regex's automaton instead belongs to the
+ * cache entry it was shared from, cached. */
 typedef struct regex {
-    struct state *entry;
+    struct arena arena;
+    struct arena cache;
+
+    struct inst *insts;
+    int ninsts;
+    int *targets;
+    int ntargets;
+
+    /* The NFA states the engines track are slots.  Instruction i outside any
+     * counted repetition is slot i; instruction i in the body of loops[l]
+     * at iteration count c is slot loops[l].base + c * loops[l].size +
+     * local[i].  loop[i] is l for the body and entry of loops[l], or -1. */
+    struct loop *loops;
+    int nloops;
+    int nslots;
+    int *loop;
+    int *local;
+    int *bodies;
+    int nbodies;
+
+    /* Bytes that no atom tells apart share a class; the DFA's transitions
+     * are per class.  reps holds a byte from each class. */
+    unsigned char classes[256];
+    unsigned char reps[256];
+    int nclasses;
+
+    /* The bytes a non-empty match can start with. */
+    unsigned char starts[32];
+
+    /* Set for rule sets with first-rule-wins priority: once a rule accepts,
+     * states belonging to lower-priority rules are dropped. */
+    int first;
+
+    /* Scratch space sized by nslots, reused by every match. */
+    struct sparse_set clist, nlist;
+    int *stack;
+    int *key;
+
+    struct dstate *start;
+    struct dstate **buckets;
+    int ndstates;
+    int flushes;
+    size_t scanned;
+
+#ifdef SONAVARA_COMPILE_CACHE
+    struct regex_cached *cached;
+#endif
+
+#ifdef SONAVARA_STATS
+    struct regex_stats stats;
+#endif
 } regex_t;
 
-struct state_list {
-    struct state *s;
-    struct state_list *next;
-};
+static void sparse_set_init(struct sparse_set *set, int size, struct arena *arena) {
+    set->n = 0;
+    set->dense = arena_alloc(arena, sizeof(*set->dense) * size);
+    set->sparse = arena_alloc(arena, sizeof(*set->sparse) * size);
+    memset(set->sparse, 0, sizeof(*set->sparse) * size);
+}
 
-regex_t *regex_compile(char const *pattern) {
-    struct regex_token *token = tokenise(pattern);
-    if (!token) {
+static int sparse_set_contains(struct sparse_set const *set, int i) {
+    int d = set->sparse[i];
+    return d < set->n && set->dense[d] == i;
+}
+
+static void sparse_set_insert(struct sparse_set *set, int i) {
+    set->sparse[i] = set->n;
+    set->dense[set->n++] = i;
+}
+
+/* Most slots most of the time are plain instructions. */
+#define SLOT_LOOP(re, slot) ((slot) < (re)->ninsts ? NULL : slot_loop(re, slot))
+
+static struct loop const *slot_loop(regex_t const *re, int slot) {
+    int lo = 0, hi = re->nloops - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (re->loops[mid].base <= slot) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return &re->loops[lo];
+}
+
+static struct inst const *slot_inst(regex_t const *re, int slot, struct loop const *l) {
+    /* l is SLOT_LOOP(re, slot). */
+    return &re->insts[l ? re->bodies[l->body + (slot - l->base) % l->size] : slot];
+}
+
+static int slot_next(regex_t const *re, int slot, struct loop const *l, int i) {
+    /* Return the slot of instruction i, a successor of slot within the same
+     * body, if any. */
+    if (!l || i < 0) {
+        return i;
+    }
+    return slot - (slot - l->base) % l->size + re->local[i];
+}
+
+static int regex_loops(regex_t *re, struct arena *scratch) {
+    /* Find the body of each counted repetition and lay out its slots.
+     * Return 0 if there are too many. */
+
+    re->loop = arena_alloc(&re->arena, sizeof(*re->loop) * re->ninsts);
+    re->local = arena_alloc(&re->arena, sizeof(*re->local) * re->ninsts);
+    re->nloops = 0;
+
+    int nedges = 0;
+    for (int i = 0; i < re->ninsts; ++i) {
+        re->loop[i] = re->local[i] = -1;
+        re->nloops += re->insts[i].type == STATE_REPEAT;
+        nedges += re->insts[i].type == STATE_BRANCH ? re->insts[i].branch.n : 2;
+    }
+
+    re->loops = arena_alloc(&re->arena, sizeof(*re->loops) * (re->nloops ? re->nloops : 1));
+    re->bodies = arena_alloc(&re->arena, sizeof(*re->bodies) * re->ninsts);
+    re->nbodies = 0;
+    int *stack = arena_alloc(scratch, sizeof(*stack) * (nedges + 1));
+    long nslots = re->ninsts;
+
+    for (int i = 0, l = 0; i < re->ninsts; ++i) {
+        struct inst const *entry = &re->insts[i];
+        if (entry->type != STATE_REPEAT) {
+            continue;
+        }
+
+        struct loop *loop = &re->loops[l];
+        loop->entry = i;
+        loop->low = entry->repeat.low;
+        loop->high = entry->repeat.high;
+        loop->counts = loop->high == -1 ? loop->low : loop->high;
+        loop->size = 0;
+        loop->base = nslots;
+        re->loop[i] = l;
+
+        int top = 0;
+        stack[top++] = entry->x;
+
+        while (top) {
+            int j = stack[--top];
+            if (j < 0 || re->loop[j] == l) {
+                continue;
+            }
+
+            re->loop[j] = l;
+
+            /* Branches are never tracked, so need no slots. */
+            struct inst const *inst = &re->insts[j];
+            if (inst->type == STATE_BRANCH) {
+                for (int k = 0; k < inst->branch.n; ++k) {
+                    stack[top++] = re->targets[inst->branch.first + k];
+                }
+                continue;
+            }
+
+            re->local[j] = loop->size++;
+
+            if (j != entry->repeat.partner) {
+                stack[top++] = inst->y;
+                stack[top++] = inst->x;
+            }
+        }
+
+        loop->body = re->nbodies;
+        re->nbodies += loop->size;
+        for (int j = 0; j < re->ninsts; ++j) {
+            if (re->loop[j] == l && j != i && re->insts[j].type != STATE_BRANCH) {
+                re->bodies[loop->body + re->local[j]] = j;
+            }
+        }
+
+        nslots += (long)loop->counts * loop->size;
+        if (nslots > SONAVARA_MAX_SLOTS) {
+            return 0;
+        }
+
+        ++l;
+    }
+
+    re->nslots = nslots;
+    return 1;
+}
+
+static void regex_classify(regex_t *re) {
+    /* Refine the partition of bytes by each atom in turn. */
+
+    memset(re->classes, 0, sizeof(re->classes));
+    re->nclasses = 1;
+
+    for (int i = 0; i < re->ninsts; ++i) {
+        struct inst const *inst = &re->insts[i];
+        if (inst->type != STATE_ATOM) {
+            continue;
+        }
+
+        int split[256][2];
+        memset(split, -1, sizeof(split));
+        int n = 0;
+
+        for (int c = 0; c < 256; ++c) {
+            int *class = &split[re->classes[c]][!!BITTEST(inst->atom, c)];
+            if (*class < 0) {
+                *class = n++;
+            }
+            re->classes[c] = *class;
+        }
+
+        re->nclasses = n;
+    }
+
+    for (int c = 255; c >= 0; --c) {
+        re->reps[re->classes[c]] = c;
+    }
+}
+
+static void nfa_closure(regex_t *re, struct sparse_set *set, int from, struct loop const *l, int i, int *match);
+
+static void regex_starts(regex_t *re) {
+    int match = 0;
+    re->clist.n = 0;
+    nfa_closure(re, &re->clist, 0, NULL, 0, &match);
+
+    memset(re->starts, 0, sizeof(re->starts));
+    for (int j = 0; j < re->clist.n; ++j) {
+        int slot = re->clist.dense[j];
+        struct inst const *inst = slot_inst(re, slot, SLOT_LOOP(re, slot));
+        if (inst->type == STATE_ATOM) {
+            for (int k = 0; k < 32; ++k) {
+                re->starts[k] |= inst->atom[k];
+            }
+        }
+    }
+}
+
+static void regex_scratch(regex_t *re) {
+    /* Set up the working space for matching and an empty DFA cache. */
+
+    sparse_set_init(&re->clist, re->nslots, &re->arena);
+    sparse_set_init(&re->nlist, re->nslots, &re->arena);
+    re->stack = arena_alloc(&re->arena, sizeof(*re->stack) * (2 * re->nslots + 1));
+    re->key = arena_alloc(&re->arena, sizeof(*re->key) * re->nslots);
+
+    re->start = NULL;
+    re->buckets = arena_alloc(&re->arena, sizeof(*re->buckets) * SONAVARA_DFA_CACHE_STATES);
+    memset(re->buckets, 0, sizeof(*re->buckets) * SONAVARA_DFA_CACHE_STATES);
+    re->ndstates = 0;
+    re->flushes = 0;
+    re->scanned = 0;
+    STATS(memset(&re->stats, 0, sizeof(re->stats)));
+}
+
+#ifdef SONAVARA_STATS
+static double stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+#endif
+
+void regex_free(regex_t *re);
+
+#if defined(SONAVARA_PARALLEL) || defined(SONAVARA_COMPILE_CACHE)
+
+static regex_t *regex_share(regex_t const *re) {
+    /* Return a regex that reads re's automaton, which must outlive it, but
+     * has working space and a DFA cache of its own. */
+
+    struct arena arena = {NULL};
+    regex_t *copy = arena_alloc(&arena, sizeof(*copy));
+    *copy = *re;
+    copy->arena = arena;
+    copy->cache.chunk = NULL;
+#ifdef SONAVARA_COMPILE_CACHE
+    copy->cached = NULL;
+#endif
+
+    regex_scratch(copy);
+    STATS(copy->stats.states = re->stats.states);
+    return copy;
+}
+
+#endif
+
+static regex_t *regex_new(struct state *entry, int first, struct arena *scratch) {
+    struct arena arena = {NULL};
+    regex_t *re = arena_alloc(&arena, sizeof(*re));
+    re->arena = arena;
+    re->cache.chunk = NULL;
+#ifdef SONAVARA_COMPILE_CACHE
+    re->cached = NULL;
+#endif
+
+    int n;
+    struct inst *insts = nfa_flatten(entry, &n, scratch, scratch);
+    re->insts = nfa_optimise(insts, n, &re->ninsts, &re->targets, &re->ntargets, &re->arena, scratch);
+    re->first = first;
+    if (!regex_loops(re, scratch)) {
+        regex_free(re);
         return NULL;
     }
+    regex_classify(re);
+    regex_scratch(re);
+    regex_starts(re);
+    STATS(re->stats.states = n);
+    return re;
+}
+
+static regex_t *regex_build(char const *pattern) {
+    struct arena scratch = {NULL};
+    regex_t *re = NULL;
+
+    struct regex_token *token = tokenise(pattern, &scratch);
+    if (token) {
+        struct state *match = state(&scratch, STATE_MATCH, NULL, NULL, 0);
+        struct state *entry = token2nfa(token, match, &scratch);
+        if (entry) {
+            re = regex_new(entry, 0, &scratch);
+        }
+    }
+
+    arena_free(&scratch);
+    return re;
+}
+
+static regex_t *regex_build_set(char const * const *patterns, int n, int first) {
+    struct arena scratch = {NULL};
+    struct state *entry = NULL;
+
+    for (int i = n - 1; i >= 0; --i) {
+        struct regex_token *token = tokenise(patterns[i], &scratch);
+        struct state *match = state(&scratch, STATE_MATCH, NULL, NULL, i);
+        struct state *s = token2nfa(token, match, &scratch);
+
+        if (!s) {
+            arena_free(&scratch);
+            return NULL;
+        }
+
+        entry = entry ? state(&scratch, STATE_SPLIT, s, entry, i) : s;
+    }
+
+    regex_t *re = entry ? regex_new(entry, first, &scratch) : NULL;
+    arena_free(&scratch);
+    return re;
+}
+
+#ifdef SONAVARA_COMPILE_CACHE
+
+/* A cached automaton: re, built from the patterns that key spells out, and
+ * shared by refs live regexes. */
+struct regex_cached {
+    struct regex_cached *next;
+    unsigned hash;
+    char *key;
+    size_t keylen;
+    int refs;
+    regex_t *re;
+};
+
+static struct regex_cached *regex_cache[SONAVARA_COMPILE_CACHE_BUCKETS];
+static pthread_mutex_t regex_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *regex_cache_key(char const * const *patterns, int n, int kind, size_t *keylen) {
+    /* Return the patterns, each NUL-terminated, after a byte telling how
+     * they're compiled: kind is -1 for regex_compile, else first. */
+
+    size_t len = 1;
+    for (int i = 0; i < n; ++i) {
+        len += strlen(patterns[i]) + 1;
+    }
 
-    struct state *state = token2nfa(token);
-    token_free(token);
+    char *key = malloc(len), *p = key;
+    *p++ = (char)(kind + 1);
+    for (int i = 0; i < n; ++i) {
+        size_t l = strlen(patterns[i]) + 1;
+        memcpy(p, patterns[i], l);
+        p += l;
+    }
+
+    *keylen = len;
+    return key;
+}
+
+static struct regex_cached *regex_cache_find(char const *key, size_t keylen, unsigned hash) {
+    struct regex_cached *c = regex_cache[hash % SONAVARA_COMPILE_CACHE_BUCKETS];
+    while (c && (c->hash != hash || c->keylen != keylen || memcmp(c->key, key, keylen) != 0)) {
+        c = c->next;
+    }
+    return c;
+}
+
+static regex_t *regex_cache_share(struct regex_cached *c) {
+    /* Take a reference to c for a regex of its own; the lock must be held. */
+
+    regex_t *re = regex_share(c->re);
+    re->cached = c;
+    ++c->refs;
+    return re;
+}
+
+static regex_t *regex_cache_compile(char const * const *patterns, int n, int kind) {
+    /* Compile patterns as regex_compile would if kind is -1, else as
+     * regex_compile_set would with kind as first, but share the automaton
+     * of a live regex compiled the same way.  The lock isn't
+     * held while building, so two threads may build the same automaton at
+     * once; the one that finishes second drops its own. */
+
+    size_t keylen;
+    char *key = regex_cache_key(patterns, n, kind, &keylen);
+
+    unsigned hash = 2166136261u;
+    for (size_t i = 0; i < keylen; ++i) {
+        hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+    }
 
-    if (!state) {
+    pthread_mutex_lock(&regex_cache_lock);
+    struct regex_cached *c = regex_cache_find(key, keylen, hash);
+    if (c) {
+        regex_t *re = regex_cache_share(c);
+        pthread_mutex_unlock(&regex_cache_lock);
+        free(key);
+        return re;
+    }
+    pthread_mutex_unlock(&regex_cache_lock);
+
+    regex_t *built = kind < 0 ? regex_build(patterns[0]) : regex_build_set(patterns, n, kind);
+    if (!built) {
+        free(key);
         return NULL;
     }
 
-    regex_t *re = malloc(sizeof(*re));
-    re->entry = state;
+    pthread_mutex_lock(&regex_cache_lock);
+    c = regex_cache_find(key, keylen, hash);
+    if (c) {
+        free(key);
+        regex_free(built);
+    } else {
+        c = malloc(sizeof(*c));
+        c->hash = hash;
+        c->key = key;
+        c->keylen = keylen;
+        c->refs = 0;
+        c->re = built;
+        c->next = regex_cache[hash % SONAVARA_COMPILE_CACHE_BUCKETS];
+        regex_cache[hash % SONAVARA_COMPILE_CACHE_BUCKETS] = c;
+    }
+    regex_t *re = regex_cache_share(c);
+    pthread_mutex_unlock(&regex_cache_lock);
+
     return re;
 }
 
+static void regex_cache_release(struct regex_cached *c) {
+    /* Drop a reference to c, freeing it with the last. */
+
+    pthread_mutex_lock(&regex_cache_lock);
+    int last = --c->refs == 0;
+    if (last) {
+        struct regex_cached **p = &regex_cache[c->hash % SONAVARA_COMPILE_CACHE_BUCKETS];
+        while (*p != c) {
+            p = &(*p)->next;
+        }
+        *p = c->next;
+    }
+    pthread_mutex_unlock(&regex_cache_lock);
+
+    if (last) {
+        regex_free(c->re);
+        free(c->key);
+        free(c);
+    }
+}
+
+#endif
+
+regex_t *regex_compile(char const *pattern) {
+    STATS(double start = stats_now());
+#ifdef SONAVARA_COMPILE_CACHE
+    regex_t *re = regex_cache_compile(&pattern, 1, -1);
+#else
+    regex_t *re = regex_build(pattern);
+#endif
+    STATS(if (re) re->stats.compile_us = stats_now() - start);
+    return re;
+}
+
+regex_t *regex_compile_set(char const * const *patterns, int n, int first) {
+    /* Compile n patterns into a single automaton.  Each DFA state's match is
+     * one more than the lowest-numbered rule it accepts for.  If first is
+     * set, a rule that has matched beats every later rule, even one that
+     * would go on to match more input. */
+
+    STATS(double start = stats_now());
+#ifdef SONAVARA_COMPILE_CACHE
+    regex_t *re = regex_cache_compile(patterns, n, first != 0);
+#else
+    regex_t *re = regex_build_set(patterns, n, first);
+#endif
+    STATS(if (re) re->stats.compile_us = stats_now() - start);
+    return re;
+}
+
+static void dcache_flush(regex_t *re) {
+    arena_free(&re->cache);
+    memset(re->buckets, 0, sizeof(*re->buckets) * SONAVARA_DFA_CACHE_STATES);
+
+    re->start = NULL;
+    re->ndstates = 0;
+}
+
 void regex_free(regex_t *re) {
-    state_free(re->entry);
-    free(re);
+#ifdef SONAVARA_COMPILE_CACHE
+    struct regex_cached *cached = re->cached;
+#endif
+
+    struct arena arena = re->arena;
+    arena_free(&re->cache);
+    arena_free(&arena);
+
+#ifdef SONAVARA_COMPILE_CACHE
+    if (cached) {
+        regex_cache_release(cached);
+    }
+#endif
 }
 
-static void state_list_prepend(struct state_list **l, struct state *s) {
-    struct state_list *nl = malloc(sizeof(*nl));
-    nl->s = s;
-    nl->next = *l;
-    *l = nl;
+/* A saved regex is a struct regex_header followed by its insts, loops,
+ * targets, bodies, loop and local arrays.  It holds no pointers, and a loaded
+ * regex reads it in place, so a saved file can be mapped rather than read.
+ * Only the build that saved a regex can load it: the header records the
+ * format version and the layout of what follows, and a regex that doesn't
+ * match is refused. */
+
+#define REGEX_SAVE_MAGIC "sonavara"
+#define REGEX_SAVE_VERSION 1
+
+struct regex_header {
+    char magic[8];
+    int version;
+    int order;
+    int inst_size;
+    int loop_size;
+    int ninsts, ntargets, nloops, nbodies, nslots;
+    int nclasses;
+    int first;
+    unsigned char classes[256];
+    unsigned char reps[256];
+    unsigned char starts[32];
+};
+
+static size_t regex_saved_size(struct regex_header const *h) {
+    return sizeof(*h) +
+        sizeof(struct inst) * (size_t)h->ninsts +
+        sizeof(struct loop) * (size_t)h->nloops +
+        sizeof(int) * ((size_t)h->ntargets + h->nbodies + 2 * (size_t)h->ninsts);
+}
+
+static char *regex_put(char *p, void const *src, size_t size) {
+    memcpy(p, src, size);
+    return p + size;
 }
 
-static void state_list_free(struct state_list *clist) {
-    while (clist) {
-        struct state_list *next = clist->next;
-        free(clist);
-        clist = next;
+size_t regex_save(regex_t const *re, void *buf, size_t size) {
+    /* Write re to the size bytes at buf, if that's enough, and return how
+     * many bytes it takes; regex_save(re, NULL, 0) just returns the size. */
+
+    struct regex_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, REGEX_SAVE_MAGIC, sizeof(h.magic));
+    h.version = REGEX_SAVE_VERSION;
+    h.order = 0x01020304;
+    h.inst_size = sizeof(struct inst);
+    h.loop_size = sizeof(struct loop);
+    h.ninsts = re->ninsts;
+    h.ntargets = re->ntargets;
+    h.nloops = re->nloops;
+    h.nbodies = re->nbodies;
+    h.nslots = re->nslots;
+    h.nclasses = re->nclasses;
+    h.first = re->first;
+    memcpy(h.classes, re->classes, sizeof(h.classes));
+    memcpy(h.reps, re->reps, sizeof(h.reps));
+    memcpy(h.starts, re->starts, sizeof(h.starts));
+
+    size_t need = regex_saved_size(&h);
+    if (!buf || size < need) {
+        return need;
     }
+
+    char *p = buf;
+    p = regex_put(p, &h, sizeof(h));
+    p = regex_put(p, re->insts, sizeof(*re->insts) * re->ninsts);
+    p = regex_put(p, re->loops, sizeof(*re->loops) * re->nloops);
+    p = regex_put(p, re->targets, sizeof(*re->targets) * re->ntargets);
+    p = regex_put(p, re->bodies, sizeof(*re->bodies) * re->nbodies);
+    p = regex_put(p, re->loop, sizeof(*re->loop) * re->ninsts);
+    regex_put(p, re->local, sizeof(*re->local) * re->ninsts);
+
+    return need;
 }
 
-static int state_list_add(struct state_list **l, struct state *s) {
-    /* Return true if any added state is STATE_MATCH. */
+static int regex_valid(regex_t const *re) {
+    /* Check that every index in a loaded regex is in range.  This catches
+     * stale and damaged files, not ones made to fool it. */
+
+#define IN_RANGE(i, n) ((i) >= 0 && (i) < (n))
+
+    for (int i = 0; i < re->ninsts; ++i) {
+        struct inst const *inst = &re->insts[i];
+
+        if (!IN_RANGE((int)inst->type, STATE_MARK) || inst->rule < 0 ||
+                !IN_RANGE(inst->x + 1, re->ninsts + 1) || !IN_RANGE(inst->y + 1, re->ninsts + 1) ||
+                !IN_RANGE(re->loop[i] + 1, re->nloops + 1)) {
+            return 0;
+        }
+
+        if (inst->type == STATE_BRANCH && (inst->branch.n < 0 || inst->branch.first < 0 ||
+                    inst->branch.first > re->ntargets - inst->branch.n)) {
+            return 0;
+        }
 
-    if (!s) {
-        return 0;
+        if ((inst->type == STATE_REPEAT || inst->type == STATE_COUNT) &&
+                (!IN_RANGE(inst->repeat.partner, re->ninsts) || re->loop[i] < 0)) {
+            return 0;
+        }
+
+        if (re->loop[i] >= 0 && i != re->loops[re->loop[i]].entry && inst->type != STATE_BRANCH) {
+            struct loop const *loop = &re->loops[re->loop[i]];
+            if (loop->body < 0 || loop->body > re->nbodies - loop->size ||
+                    !IN_RANGE(re->local[i], loop->size) || re->bodies[loop->body + re->local[i]] != i) {
+                return 0;
+            }
+        }
     }
 
-    if (s->type == STATE_SPLIT) {
-        int a = state_list_add(l, s->o1);
-        int b = state_list_add(l, s->o2);
-        return a || b;
+    for (int i = 0; i < re->ntargets; ++i) {
+        if (!IN_RANGE(re->targets[i], re->ninsts)) {
+            return 0;
+        }
     }
 
-    state_list_prepend(l, s);
-    return s->type == STATE_MATCH;
+    for (int i = 0; i < re->nbodies; ++i) {
+        if (!IN_RANGE(re->bodies[i], re->ninsts)) {
+            return 0;
+        }
+    }
+
+    long slots = re->ninsts;
+    for (int l = 0; l < re->nloops; ++l) {
+        struct loop const *loop = &re->loops[l];
+        if (!IN_RANGE(loop->entry, re->ninsts) || loop->size < 1 || loop->counts < 0 ||
+                loop->body < 0 || loop->body > re->nbodies - loop->size || loop->base != slots) {
+            return 0;
+        }
+        slots += (long)loop->counts * loop->size;
+        if (slots > re->nslots) {
+            return 0;
+        }
+    }
+
+    for (int c = 0; c < 256; ++c) {
+        if (re->classes[c] >= re->nclasses || (c < re->nclasses && re->classes[re->reps[c]] != c)) {
+            return 0;
+        }
+    }
+
+#undef IN_RANGE
+
+    return slots == re->nslots && re->ninsts > 0;
+}
+
+regex_t *regex_load(void const *buf, size_t size) {
+    /* Return the regex regex_save wrote to the size bytes at buf, or NULL if
+     * they don't hold one this build can use.  buf must be aligned as
+     * malloc or mmap would align it, and left alone until the regex is
+     * freed: the automaton is read from it in place. */
+
+    struct regex_header h;
+    if (size < sizeof(h) || (size_t)buf % sizeof(int)) {
+        return NULL;
+    }
+
+    memcpy(&h, buf, sizeof(h));
+    if (memcmp(h.magic, REGEX_SAVE_MAGIC, sizeof(h.magic)) != 0 ||
+            h.version != REGEX_SAVE_VERSION || h.order != 0x01020304 ||
+            h.inst_size != sizeof(struct inst) || h.loop_size != sizeof(struct loop) ||
+            h.ninsts < 1 || h.ntargets < 0 || h.nloops < 0 || h.nbodies < 0 ||
+            h.nslots < h.ninsts || h.nslots > SONAVARA_MAX_SLOTS ||
+            h.nclasses < 1 || h.nclasses > 256 || regex_saved_size(&h) != size) {
+        return NULL;
+    }
+
+    struct arena arena = {NULL};
+    regex_t *re = arena_alloc(&arena, sizeof(*re));
+    re->arena = arena;
+    re->cache.chunk = NULL;
+#ifdef SONAVARA_COMPILE_CACHE
+    re->cached = NULL;
+#endif
+
+    char *p = (char *)buf + sizeof(h);
+    re->ninsts = h.ninsts;
+    re->insts = (struct inst *)p;
+    p += sizeof(*re->insts) * h.ninsts;
+    re->nloops = h.nloops;
+    re->loops = (struct loop *)p;
+    p += sizeof(*re->loops) * h.nloops;
+    re->ntargets = h.ntargets;
+    re->targets = (int *)p;
+    p += sizeof(*re->targets) * h.ntargets;
+    re->nbodies = h.nbodies;
+    re->bodies = (int *)p;
+    p += sizeof(*re->bodies) * h.nbodies;
+    re->loop = (int *)p;
+    p += sizeof(*re->loop) * h.ninsts;
+    re->local = (int *)p;
+
+    re->nslots = h.nslots;
+    re->nclasses = h.nclasses;
+    re->first = h.first;
+    memcpy(re->classes, h.classes, sizeof(re->classes));
+    memcpy(re->reps, h.reps, sizeof(re->reps));
+    memcpy(re->starts, h.starts, sizeof(re->starts));
+
+    if (!regex_valid(re)) {
+        regex_free(re);
+        return NULL;
+    }
+
+    regex_scratch(re);
+    return re;
 }
 
-static int step(struct state_list *clist, int c, struct state_list **nlist) {
-    /* Return true if any state added to nlist is STATE_MATCH. */
+static void nfa_add(regex_t *re, struct sparse_set *set, int slot, int i, int *match, int *top) {
+    /* Add slot, which runs instruction i, to set, and queue it for
+     * nfa_closure if it has epsilon moves of its own. */
 
-    int r = 0;
+    if (sparse_set_contains(set, slot)) {
+        return;
+    }
+
+    sparse_set_insert(set, slot);
+
+    struct inst const *inst = &re->insts[i];
+    if (inst->type == STATE_MATCH) {
+        if (!*match || inst->rule < *match - 1) {
+            *match = inst->rule + 1;
+        }
+    } else if (inst->type != STATE_ATOM) {
+        re->stack[(*top)++] = slot;
+    }
+}
+
+static void nfa_visit(regex_t *re, struct sparse_set *set, int from, struct loop const *l, int i, int *match, int *top) {
+    /* Add instruction i, a successor of slot from, which is in l, to set.
+     * A branch is never added itself; its targets are its closure. */
+
+    if (i < 0) {
+        return;
+    }
+
+    struct inst const *inst = &re->insts[i];
+    if (inst->type == STATE_BRANCH) {
+        for (int k = 0; k < inst->branch.n; ++k) {
+            int t = re->targets[inst->branch.first + k];
+            nfa_add(re, set, slot_next(re, from, l, t), t, match, top);
+        }
+    } else {
+        nfa_add(re, set, slot_next(re, from, l, i), i, match, top);
+    }
+}
+
+static void nfa_closure(regex_t *re, struct sparse_set *set, int from, struct loop const *l, int i, int *match) {
+    /* Add instruction i, a successor of slot from, which is in l, and
+     * everything reachable from it by epsilon moves to set.  Match
+     * instructions also update *match. */
 
-    for (; clist; clist = clist->next) {
-        struct state *s = clist->s;
-        if (s->type == STATE_ATOM && BITTEST(s->atom, c)) {
-            if (state_list_add(nlist, s->o1)) {
-                r = 1;
+    int top = 0;
+    nfa_visit(re, set, from, l, i, match, &top);
+
+    while (top) {
+        int slot = re->stack[--top];
+
+        l = SLOT_LOOP(re, slot);
+        struct inst const *inst = slot_inst(re, slot, l);
+        if (inst->type == STATE_SPLIT) {
+            nfa_visit(re, set, slot, l, inst->y, match, &top);
+            nfa_visit(re, set, slot, l, inst->x, match, &top);
+        } else if (inst->type == STATE_REPEAT) {
+            struct loop const *body = &re->loops[re->loop[slot]];
+            if (body->low == 0) {
+                nfa_visit(re, set, slot, NULL, inst->y, match, &top);
+            }
+            if (body->counts) {
+                nfa_visit(re, set, body->base, body, inst->x, match, &top);
+            }
+        } else if (inst->type == STATE_COUNT) {
+            /* This ends iteration n. */
+            int n = (slot - l->base) / l->size + 1;
+            if (n >= l->low) {
+                nfa_visit(re, set, slot, NULL, inst->y, match, &top);
+            }
+            if (l->high == -1 || n < l->high) {
+                int c = n < l->counts ? n : l->counts - 1;
+                nfa_visit(re, set, l->base + c * l->size, l, inst->x, match, &top);
             }
         }
     }
+}
+
+static void nfa_prune(regex_t *re, struct sparse_set *set, int match) {
+    /* Drop the states of rules that lost to rule match - 1. */
 
-    return r;
+    int kept = 0;
+    for (int j = 0; j < set->n; ++j) {
+        int i = set->dense[j];
+        if (slot_inst(re, i, SLOT_LOOP(re, i))->rule < match) {
+            set->sparse[i] = kept;
+            set->dense[kept++] = i;
+        }
+    }
+    set->n = kept;
 }
 
-static int match(regex_t *re, char const *s, int prefix) {
+static int nfa_step(regex_t *re, int const *states, int n, int c, struct sparse_set *nlist) {
+    /* Fill nlist with the states reached from states on c.  Return its
+     * match. */
+
+    int match = 0;
+    nlist->n = 0;
+
+    for (int j = 0; j < n; ++j) {
+        struct loop const *l = SLOT_LOOP(re, states[j]);
+        struct inst const *inst = slot_inst(re, states[j], l);
+        if (inst->type == STATE_ATOM && BITTEST(inst->atom, c)) {
+            nfa_closure(re, nlist, states[j], l, inst->x, &match);
+        }
+    }
+
+    if (re->first && match) {
+        nfa_prune(re, nlist, match);
+    }
+
+    return match;
+}
+
+/* Whether s has more input before end, or before its NUL if end is NULL. */
+#define MORE(s, end) ((end) ? (s) < (end) : *(s) != 0)
+
+static int match_result(int len, int longest_match, int empty, int prefix) {
     /* If !prefix, we return 1 or 0 if we match the entire string or not.
      * If prefix, we return the number of characters that generate a match,
-     * which may be 0.  If there's no match, return -1. */
+     * which may be 0.  If there's no match, return -1.  len is -1 if the
+     * matcher stopped before the end of the string, having no live states
+     * left. */
+
+    /* Exact non-empty match. */
+    if (len > 0 && longest_match == len) {
+        return prefix ? len : 1;
+    }
 
-    struct state_list *clist = NULL;
-    state_list_add(&clist, re->entry);
+    if (len == 0 && empty) {
+        // We may match the empty string.
+        return prefix ? 0 : 1;
+    }
+
+    /* No exact match. */
+    return prefix ? longest_match : 0;
+}
+
+static int nfa_match(regex_t *re, char const *s, char const *end, int prefix) {
+    struct sparse_set *clist = &re->clist,
+                      *nlist = &re->nlist;
+
+    int empty = 0;
+    clist->n = 0;
+    nfa_closure(re, clist, 0, NULL, 0, &empty);
+    STATS(++re->stats.nfa_matches);
 
     int len = 0;
     int longest_match = -1;
 
-    for (; *s; ++s) {
+    for (; MORE(s, end); ++s) {
         ++len;
 
-        struct state_list *nlist = NULL;
-        int r = step(clist, *s, &nlist);
-        state_list_free(clist);
+        int r = nfa_step(re, clist->dense, clist->n, (unsigned char)*s, nlist);
+
+        struct sparse_set *t = clist;
         clist = nlist;
+        nlist = t;
+
+        STATS(++re->stats.bytes);
+        STATS(if (clist->n > re->stats.peak) re->stats.peak = clist->n);
 
         if (r) {
             longest_match = len;
         }
+
+        if (!clist->n && MORE(s + 1, end)) {
+            len = -1;
+            break;
+        }
     }
 
-    /* Exact non-empty match. */
-    if (longest_match == len) {
-        state_list_free(clist);
-        return prefix ? len : 1;
+    return match_result(len, longest_match, empty, prefix);
+}
+
+static int dstate_key(regex_t *re, struct sparse_set const *set) {
+    /* Store the sorted atom instructions in set, which are all that tell
+     * DFA states apart, in re->key and return how many there are. */
+
+    int n = 0;
+    for (int j = 0; j < set->n; ++j) {
+        int slot = set->dense[j];
+        if (slot_inst(re, slot, SLOT_LOOP(re, slot))->type == STATE_ATOM) {
+            re->key[n++] = slot;
+        }
     }
 
-    if (len == 0) {
-        // We may match the empty string.
-        for (struct state_list *search = clist; search; search = search->next) {
-            if (search->s->type == STATE_MATCH) {
-                state_list_free(clist);
-                return prefix ? 0 : 1;
+    qsort(re->key, n, sizeof(*re->key), int_cmp);
+    return n;
+}
+
+static struct dstate *dstate_find(regex_t *re, struct sparse_set const *set, int match) {
+    /* Find or create the DFA state for the NFA states in set.  If the cache
+     * has to be flushed to make room, re->flushes is incremented and every
+     * previously returned dstate is gone. */
+
+    int n = dstate_key(re, set);
+
+    unsigned long h = 2166136261u ^ match;
+    for (int i = 0; i < n; ++i) {
+        h = (h ^ (unsigned long)re->key[i]) * 16777619u;
+    }
+    h %= SONAVARA_DFA_CACHE_STATES;
+
+    for (struct dstate *d = re->buckets[h]; d; d = d->chain) {
+        if (d->nstates == n && d->match == match &&
+                memcmp(d->states, re->key, sizeof(*re->key) * n) == 0) {
+            return d;
+        }
+    }
+
+    if (re->ndstates >= SONAVARA_DFA_CACHE_STATES) {
+        dcache_flush(re);
+        ++re->flushes;
+        STATS(++re->stats.flushes);
+    }
+
+    STATS(++re->stats.dstates);
+    STATS(if (set->n > re->stats.peak) re->stats.peak = set->n);
+
+    struct dstate *d = arena_alloc(&re->cache,
+            sizeof(*d) + sizeof(*d->next) * re->nclasses + sizeof(*re->key) * n);
+    d->id = re->ndstates++;
+    d->match = match;
+    d->nstates = n;
+    d->states = (int *)&d->next[re->nclasses];
+    d->loop = NULL;
+    memcpy(d->states, re->key, sizeof(*re->key) * n);
+    memset(d->next, 0, sizeof(*d->next) * re->nclasses);
+
+    d->chain = re->buckets[h];
+    re->buckets[h] = d;
+
+    return d;
+}
+
+static struct dstate *dstate_start(regex_t *re) {
+    if (!re->start) {
+        int match = 0;
+        re->clist.n = 0;
+        nfa_closure(re, &re->clist, 0, NULL, 0, &match);
+        re->start = dstate_find(re, &re->clist, match);
+    }
+
+    return re->start;
+}
+
+static struct dstate *dstate_step(regex_t *re, struct dstate *d, int class) {
+    int match = nfa_step(re, d->states, d->nstates, re->reps[class], &re->nlist),
+        flushes = re->flushes;
+
+    struct dstate *next = dstate_find(re, &re->nlist, match);
+    if (re->flushes == flushes) {
+        d->next[class] = next;
+    }
+
+    return next;
+}
+
+static void scan_set_add(unsigned char *set, int c) {
+    /* Add c to a scan.c byte set. */
+
+    set[(c & 15) + (c & 128 ? 16 : 0)] |= 1 << ((c >> 4) & 7);
+}
+
+static unsigned char *dstate_loop(regex_t *re, struct dstate *d) {
+    /* Work out which bytes d loops on by stepping the NFA, which can't
+     * flush the cache out from under d as dstate_step could. */
+
+    if (!d->loop) {
+        d->loop = arena_alloc(&re->cache, 32);
+        memset(d->loop, 0, 32);
+
+        for (int class = 0; class < re->nclasses; ++class) {
+            int match = nfa_step(re, d->states, d->nstates, re->reps[class], &re->nlist);
+            if (match != d->match || dstate_key(re, &re->nlist) != d->nstates ||
+                    memcmp(re->key, d->states, sizeof(*re->key) * d->nstates) != 0) {
+                continue;
+            }
+
+            for (int c = 0; c < 256; ++c) {
+                if (re->classes[c] == class) {
+                    scan_set_add(d->loop, c);
+                }
             }
         }
     }
 
-    state_list_free(clist);
+    return d->loop;
+}
 
-    /* No exact match. */
-    return prefix ? longest_match : 0;
+static int dfa_match(regex_t *re, char const *s, char const *end, int prefix, int *result) {
+    /* Match as match() does, storing the result in *result.  Return 0 if
+     * the DFA gave up. */
+
+    struct dstate *d = dstate_start(re);
+    int empty = d->match;
+
+    int len = 0;
+    int longest_match = -1;
+
+    int flushes = re->flushes,
+        flushed_at = 0;
+
+    for (; MORE(s, end); ++s) {
+        ++len;
+
+        int class = re->classes[(unsigned char)*s];
+        struct dstate *next = d->next[class];
+        if (!next) {
+            next = dstate_step(re, d, class);
+
+            if (re->flushes != flushes) {
+                if (re->scanned + (len - flushed_at) <
+                        (size_t)SONAVARA_DFA_MIN_BYTES_PER_STATE * SONAVARA_DFA_CACHE_STATES) {
+                    re->scanned = 0;
+                    STATS(re->stats.bytes += len);
+                    return 0;
+                }
+
+                re->scanned = 0;
+                flushes = re->flushes;
+                flushed_at = len;
+            }
+        }
+        /* Skip the rest of a run that keeps us in this state.  Without an
+         * end the input can't be read ahead safely. */
+        if (next == d && end) {
+            char const *run = scan_run(dstate_loop(re, d), s + 1, end);
+            len += run - (s + 1);
+            s = run - 1;
+        }
+
+        d = next;
+
+        if (d->match) {
+            longest_match = len;
+        }
+
+        if (!d->nstates && MORE(s + 1, end)) {
+            re->scanned += len - flushed_at;
+            STATS(re->stats.bytes += len);
+            *result = match_result(-1, longest_match, empty, prefix);
+            return 1;
+        }
+    }
+
+    re->scanned += len - flushed_at;
+    STATS(re->stats.bytes += len);
+
+    *result = match_result(len, longest_match, empty, prefix);
+    return 1;
+}
+
+static int match(regex_t *re, char const *s, char const *end, int prefix) {
+    STATS(++re->stats.matches);
+
+    /* Most failed matches fail on their first byte; answer those without
+     * touching the automata. */
+    if (MORE(s, end) && !BITTEST(re->starts, (unsigned char)*s)) {
+        return match_result(-1, -1, 0, prefix);
+    }
+
+    int result;
+    if (dfa_match(re, s, end, prefix, &result)) {
+        return result;
+    }
+
+    return nfa_match(re, s, end, prefix);
 }
 
 int regex_match(regex_t *re, char const *s) {
-    return match(re, s, 0);
+    return match(re, s, NULL, 0);
 }
 
 int regex_match_prefix(regex_t *re, char const *s) {
-    return match(re, s, 1);
+    return match(re, s, NULL, 1);
+}
+
+/* As above, for the len bytes at s, which may include NULs. */
+
+int regex_match_n(regex_t *re, char const *s, size_t len) {
+    return match(re, s, s + len, 0);
+}
+
+int regex_match_prefix_n(regex_t *re, char const *s, size_t len) {
+    return match(re, s, s + len, 1);
+}
+
+
+static void match_many(regex_t *re, char const * const *inputs, size_t n, int *results, int prefix) {
+    /* Store in results[i] what match() would return for inputs[i].  Inputs
+     * step together through transitions the DFA already has.  One that
+     * needs a new transition is matched on its own, and if that flushes the
+     * cache, the others start over.  The last few are matched on their own
+     * too. */
+
+    size_t index[SONAVARA_MATCH_LANES];
+    char const *s[SONAVARA_MATCH_LANES];
+    struct dstate *d[SONAVARA_MATCH_LANES];
+    int len[SONAVARA_MATCH_LANES], longest_match[SONAVARA_MATCH_LANES], empty[SONAVARA_MATCH_LANES];
+    size_t next = 0;
+
+    for (int k = 0; k < SONAVARA_MATCH_LANES; ++k) {
+        index[k] = (size_t)-1;
+    }
+
+    for (int k = 0;;) {
+        if (index[k] == (size_t)-1) {
+            /* Give lane k the next input the first byte doesn't rule out. */
+            while (next < n && *inputs[next] && !BITTEST(re->starts, (unsigned char)*inputs[next])) {
+                results[next++] = match_result(-1, -1, 0, prefix);
+                STATS(++re->stats.matches);
+            }
+
+            if (next == n) {
+                for (int j = 0; j < SONAVARA_MATCH_LANES; ++j) {
+                    if (index[j] != (size_t)-1) {
+                        results[index[j]] = match(re, inputs[index[j]], NULL, prefix);
+                    }
+                }
+                return;
+            }
+
+            /* With the start state missing, the cache is empty, so this
+             * can't flush it. */
+            index[k] = next;
+            s[k] = inputs[next++];
+            d[k] = dstate_start(re);
+            len[k] = 0;
+            longest_match[k] = -1;
+            empty[k] = d[k]->match;
+        }
+
+        if (++k < SONAVARA_MATCH_LANES) {
+            continue;
+        }
+
+        /* Every lane has an input: step them all until one needs more than
+         * a cached transition. */
+        struct dstate *t;
+        for (;;) {
+            for (k = 0; k < SONAVARA_MATCH_LANES; ++k) {
+                unsigned char c = *s[k];
+                t = d[k]->next[re->classes[c]];
+                if (!c || !t || !t->nstates) {
+                    goto stop;
+                }
+
+                d[k] = t;
+                ++s[k];
+                ++len[k];
+                longest_match[k] = t->match ? len[k] : longest_match[k];
+            }
+        }
+
+    stop:
+        if (!*s[k]) {
+            re->scanned += len[k];
+            STATS(re->stats.bytes += len[k]);
+            STATS(++re->stats.matches);
+            results[index[k]] = match_result(len[k], longest_match[k], empty[k], prefix);
+        } else if (t) {
+            /* No state is live after this byte, so the match can't grow. */
+            ++len[k];
+            if (t->match) {
+                longest_match[k] = len[k];
+            }
+            re->scanned += len[k];
+            STATS(re->stats.bytes += len[k]);
+            STATS(++re->stats.matches);
+            results[index[k]] = match_result(s[k][1] ? -1 : len[k], longest_match[k], empty[k], prefix);
+        } else {
+            int flushes = re->flushes;
+            results[index[k]] = match(re, inputs[index[k]], NULL, prefix);
+
+            if (re->flushes != flushes) {
+                struct dstate *start = dstate_start(re);
+                for (int j = 0; j < SONAVARA_MATCH_LANES; ++j) {
+                    s[j] = inputs[index[j]];
+                    d[j] = start;
+                    len[j] = 0;
+                    longest_match[j] = -1;
+                    empty[j] = start->match;
+                }
+            }
+        }
+
+        index[k] = (size_t)-1;
+    }
+}
+
+#ifdef SONAVARA_PARALLEL
+
+struct match_part {
+    regex_t *re;
+    char const * const *inputs;
+    size_t n;
+    int *results;
+    int prefix;
+};
+
+static void *match_part_run(void *arg) {
+    struct match_part *part = arg;
+    match_many(part->re, part->inputs, part->n, part->results, part->prefix);
+    return NULL;
+}
+
+#endif
+
+static void match_batch(regex_t *re, char const * const *inputs, size_t n, int *results, int prefix) {
+#ifdef SONAVARA_PARALLEL
+    size_t nthreads = n / SONAVARA_MATCH_BATCH;
+    if (nthreads > SONAVARA_MATCH_THREADS) {
+        nthreads = SONAVARA_MATCH_THREADS;
+    }
+
+    if (nthreads > 1) {
+        /* This thread takes the first part with re itself. */
+        pthread_t threads[SONAVARA_MATCH_THREADS];
+        struct match_part parts[SONAVARA_MATCH_THREADS];
+        int started[SONAVARA_MATCH_THREADS];
+
+        for (size_t t = 1; t < nthreads; ++t) {
+            size_t from = n * t / nthreads;
+            parts[t].re = regex_share(re);
+            parts[t].inputs = inputs + from;
+            parts[t].n = n * (t + 1) / nthreads - from;
+            parts[t].results = results + from;
+            parts[t].prefix = prefix;
+
+            started[t] = pthread_create(&threads[t], NULL, match_part_run, &parts[t]) == 0;
+            if (!started[t]) {
+                match_part_run(&parts[t]);
+            }
+        }
+
+        match_many(re, inputs, n / nthreads, results, prefix);
+
+        for (size_t t = 1; t < nthreads; ++t) {
+            if (started[t]) {
+                pthread_join(threads[t], NULL);
+            }
+
+#ifdef SONAVARA_STATS
+            struct regex_stats const *part = &parts[t].re->stats;
+            re->stats.dstates += part->dstates;
+            re->stats.flushes += part->flushes;
+            re->stats.matches += part->matches;
+            re->stats.nfa_matches += part->nfa_matches;
+            re->stats.bytes += part->bytes;
+            if (part->peak > re->stats.peak) {
+                re->stats.peak = part->peak;
+            }
+#endif
+
+            regex_free(parts[t].re);
+        }
+        return;
+    }
+#endif
+
+    match_many(re, inputs, n, results, prefix);
+}
+
+#ifdef SONAVARA_STATS
+
+void regex_stats(regex_t const *re, struct regex_stats *stats) {
+    *stats = re->stats;
+    stats->insts = re->ninsts;
+    stats->slots = re->nslots;
+}
+
+#endif
+
+/* Match each of the n NUL-terminated inputs as regex_match and
+ * regex_match_prefix do, storing the results in results.  This is much
+ * cheaper than a call per input for batches of short strings. */
+
+void regex_match_many(regex_t *re, char const * const *inputs, size_t n, int *results) {
+    match_batch(re, inputs, n, results, 0);
+}
+
+void regex_match_prefix_many(regex_t *re, char const * const *inputs, size_t n, int *results) {
+    match_batch(re, inputs, n, results, 1);
 }
 
 #endif
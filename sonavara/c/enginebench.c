@@ -0,0 +1,380 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "engine.c"
+
+/* Times the engine and prints one tab-separated line per measurement: the
+ * benchmark, the unit, and the value.  Compare two runs' output to spot a
+ * regression.
+ *
+ * Lexing is timed the way a lexer drives the engine, one regex_match_prefix
+ * per token, over corpora of each kind of token.  The run fails if the time
+ * per byte grows with the input: each token must cost time in proportion to
+ * its own length, not to the input left after it.
+ *
+ * Then compiling, single calls on short fields, pathological counted
+ * repetitions, and long tokens with each scan.c kernel the CPU supports are
+ * timed, and the peak RSS is reported last. */
+
+static char const *rules[] = {
+    "[a-zA-Z_][a-zA-Z0-9_]*",
+    "0x[0-9a-fA-F]+|[0-9]+(\\.[0-9]+)?([eE][-+]?[0-9]+)?",
+    "\"([^\"\\\\]|\\\\.)*\"",
+    "/\\*([^*]|\\*+[^*/])*\\*+/|//[^\n]*",
+    "[ \t\n]+",
+    "[-+*/=;(){}]",
+};
+
+static char const *mixed[] = {
+    "int", "x", "=", "42", ";", "\n", "while", "(", "counter", ")",
+    "{", "}", "\"a string literal\"", "+", "identifier_0", "  ",
+};
+
+static char const *identifiers[] = {
+    "i", "x", "count", "lexer_state", "HTTPRequestHandler", "_reserved",
+    "a_rather_long_identifier_name_0", "tmp2",
+};
+
+static char const *numbers[] = {
+    "0", "7", "42", "65535", "3.14159", "1e10", "6.02e+23", "0x7fffffff",
+};
+
+static char const *strings[] = {
+    "\"\"", "\"ok\"", "\"a string literal\"", "\"with \\\"escapes\\\" in\"",
+    "\"C:\\\\path\\\\to\\\\file\"", "\"a somewhat longer string, as messages are\"",
+};
+
+static char const *comments[] = {
+    "/* short */", "/** A doc comment,\n * over lines. */", "// to the end of the line\n",
+    "/* stars ** inside * */",
+};
+
+static char const *long_words[] = {
+    "a_rather_long_identifier_name_of_the_sort_generated_code_has_0",
+    "\"a string literal long enough to hold a log line, with some punctuation: [ok]\"",
+    "                                                                ",
+};
+
+#define COUNT(a) (sizeof(a) / sizeof(*(a)))
+
+static char const *patterns[] = {
+    "[a-zA-Z_][a-zA-Z0-9_]*",
+    "[0-9]{1,3}(\\.[0-9]{1,3}){3}",
+    "[a-z0-9._%+-]+@[a-z0-9.-]+\\.[a-z]{2,}",
+    "[0-9]{4}-[0-9]{2}-[0-9]{2}T[0-9]{2}:[0-9]{2}:[0-9]{2}",
+    "(if|else|while|for|return|break|continue|switch|case|default)",
+    "\"([^\"\\\\]|\\\\.)*\"",
+    "(?i:select|insert|update|delete)[ \t]+.*",
+    "([a-f0-9]{8})-([a-f0-9]{4})-([a-f0-9]{4})-([a-f0-9]{4})-([a-f0-9]{12})",
+};
+
+static void report(char const *bench, char const *unit, double value) {
+    printf("%s\t%s\t%.2f\n", bench, unit, value);
+}
+
+static char *source(size_t size, char const **words, size_t nwords) {
+    /* Return at least size bytes of words, each followed by a space. */
+
+    size_t longest = 0;
+    for (size_t i = 0; i < nwords; ++i) {
+        if (strlen(words[i]) > longest) {
+            longest = strlen(words[i]);
+        }
+    }
+
+    char *s = malloc(size + longest + 2);
+    size_t n = 0;
+    unsigned r = 1;
+
+    while (n < size) {
+        r = r * 1103515245 + 12345;
+        char const *w = words[(r >> 16) % nwords];
+        size_t len = strlen(w);
+        memcpy(s + n, w, len);
+        n += len;
+        s[n++] = ' ';
+    }
+
+    s[n] = 0;
+    return s;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double lex(regex_t *re, char const *s, int bounded, size_t *tokens) {
+    /* Return the time in ns per byte to lex s, which is NUL-terminated, but
+     * only seen as such by the engine if !bounded, and store how many
+     * tokens it held in *tokens. */
+
+    size_t len = strlen(s);
+    char const *end = s + len;
+    double start = now();
+
+    *tokens = 0;
+    while (s < end) {
+        int n = bounded ? regex_match_prefix_n(re, s, end - s) : regex_match_prefix(re, s);
+        if (n <= 0) {
+            fprintf(stderr, "FAIL: no token at %.16s\n", s);
+            exit(1);
+        }
+        s += n;
+        ++*tokens;
+    }
+
+    return (now() - start) * 1e9 / len;
+}
+
+static double best_of(regex_t *re, char const *s, int bounded, size_t *tokens) {
+    /* Warm the DFA cache, then take the best of a few runs. */
+
+    lex(re, s, bounded, tokens);
+    double best = lex(re, s, bounded, tokens);
+    for (int i = 0; i < 2; ++i) {
+        double t = lex(re, s, bounded, tokens);
+        if (t < best) {
+            best = t;
+        }
+    }
+
+    return best;
+}
+
+static void corpus(regex_t *re, char const *name, char const **words, size_t nwords) {
+    char *s = source(1 << 22, words, nwords);
+    size_t tokens;
+    double best = best_of(re, s, 0, &tokens);
+    char bench[64];
+
+    snprintf(bench, sizeof(bench), "lex/%s", name);
+    report(bench, "MB/s", 1e3 / best);
+    report(bench, "ns/token", best * strlen(s) / tokens);
+
+    free(s);
+}
+
+static int growth(regex_t *re) {
+    /* Return 0 if lexing time per byte grows with the input. */
+
+    double first = 0, last = 0;
+
+    for (size_t size = 1 << 16; size <= 1 << 22; size <<= 2) {
+        char *s = source(size, mixed, COUNT(mixed));
+        size_t tokens;
+        double best = best_of(re, s, 0, &tokens);
+        char bench[64];
+
+        snprintf(bench, sizeof(bench), "lex/mixed/%zu", size);
+        report(bench, "ns/byte", best);
+        if (!first) {
+            first = best;
+        }
+        last = best;
+
+        free(s);
+    }
+
+    /* 64x the input; quadratic lexing would be 64x slower per byte. */
+    if (last > first * 4) {
+        fprintf(stderr, "FAIL: lexing time per byte grew from %.2f to %.2f ns\n", first, last);
+        return 0;
+    }
+
+    return 1;
+}
+
+static void compiling(void) {
+    /* Compile every pattern over and over for a fifth of a second. */
+
+    size_t compiled = 0;
+    double start = now(), elapsed;
+
+    do {
+        for (size_t i = 0; i < COUNT(patterns); ++i) {
+            regex_t *re = regex_compile(patterns[i]);
+            if (!re) {
+                fprintf(stderr, "FAIL: /%s/ did not compile\n", patterns[i]);
+                exit(1);
+            }
+            regex_free(re);
+        }
+        compiled += COUNT(patterns);
+    } while ((elapsed = now() - start) < 0.2);
+
+    report("compile", "us/pattern", elapsed * 1e6 / compiled);
+}
+
+static void fields(void) {
+    /* Time single calls on short fields, about half of which match,
+     * against matching them all in one batch. */
+
+    regex_t *re = regex_compile("[0-9a-f]+(-[0-9a-f]+)*");
+    size_t n = 1 << 18;
+    char *pool = malloc(n * 24);
+    char const **inputs = malloc(sizeof(*inputs) * n);
+    int *results = malloc(sizeof(*results) * n);
+    unsigned r = 1;
+
+    for (size_t i = 0; i < n; ++i) {
+        char const *alphabet = i % 2 ? "0123456789abcdef-@." : "0123456789abcdef";
+        char *p = pool + i * 24;
+        int len = 6 + (r >> 16) % 14;
+        for (int j = 0; j < len; ++j) {
+            r = r * 1103515245 + 12345;
+            p[j] = alphabet[(r >> 16) % strlen(alphabet)];
+        }
+        p[len] = 0;
+        inputs[i] = p;
+    }
+
+    double best[3] = {1e9, 1e9, 1e9};
+    int matched = 0;
+
+    for (int rep = 0; rep < 4; ++rep) {
+        double t0 = now();
+        for (size_t i = 0; i < n; ++i) {
+            matched += regex_match(re, inputs[i]);
+        }
+        double t1 = now();
+        for (size_t i = 0; i < n; ++i) {
+            matched += regex_match_prefix(re, inputs[i]) > 0;
+        }
+        double t2 = now();
+        regex_match_many(re, inputs, n, results);
+        double t3 = now();
+
+        double t[3] = {t1 - t0, t2 - t1, t3 - t2};
+        for (int i = 0; i < 3; ++i) {
+            if (t[i] < best[i]) {
+                best[i] = t[i];
+            }
+        }
+    }
+
+    if (!matched) {
+        fprintf(stderr, "FAIL: no field matched\n");
+        exit(1);
+    }
+
+    report("fields/regex_match", "ns/call", best[0] * 1e9 / n);
+    report("fields/regex_match_prefix", "ns/call", best[1] * 1e9 / n);
+    report("fields/regex_match_many", "ns/input", best[2] * 1e9 / n);
+
+    free(results);
+    free(inputs);
+    free(pool);
+    regex_free(re);
+}
+
+static void pathological(void) {
+    /* (a?){n}a{n} against a^n has the NFA track every way of splitting the
+     * a's between the two halves. */
+
+    for (int n = 8; n <= 64; n *= 2) {
+        char pattern[32], bench[64];
+        snprintf(pattern, sizeof(pattern), "(a?){%d}a{%d}", n, n);
+
+        double start = now();
+        regex_t *re = regex_compile(pattern);
+        double compiled = now();
+        if (!re) {
+            fprintf(stderr, "FAIL: /%s/ did not compile\n", pattern);
+            exit(1);
+        }
+
+        char *s = malloc(n + 1);
+        memset(s, 'a', n);
+        s[n] = 0;
+
+        int reps = 0;
+        double matching = now(), elapsed;
+        do {
+            if (!regex_match(re, s)) {
+                fprintf(stderr, "FAIL: /%s/ should match a{%d}\n", pattern, n);
+                exit(1);
+            }
+            ++reps;
+        } while ((elapsed = now() - matching) < 0.05);
+
+        snprintf(bench, sizeof(bench), "pathological/%d", n);
+        report(bench, "compile_us", (compiled - start) * 1e6);
+        report(bench, "ns/match", elapsed * 1e9 / reps);
+
+        free(s);
+        regex_free(re);
+    }
+}
+
+static void kernels(regex_t *re) {
+    struct {
+        char const *name;
+        char const *(*run)(unsigned char const *set, char const *s, char const *end);
+        int supported;
+    } kernels[] = {
+        {"scalar", scan_run_scalar, 1},
+#ifdef SCAN_SIMD
+        {"ssse3", scan_run_ssse3, __builtin_cpu_supports("ssse3")},
+        {"avx2", scan_run_avx2, __builtin_cpu_supports("avx2")},
+#endif
+    };
+
+    char *s = source(1 << 22, long_words, COUNT(long_words));
+    char const *(*picked)(unsigned char const *set, char const *s, char const *end) = scan_run;
+    size_t tokens;
+
+    report("long/nul-terminated", "MB/s", 1e3 / best_of(re, s, 0, &tokens));
+
+    for (size_t i = 0; i < COUNT(kernels); ++i) {
+        if (!kernels[i].supported) {
+            continue;
+        }
+
+        char bench[64];
+        snprintf(bench, sizeof(bench), "long/%s", kernels[i].name);
+        scan_run = kernels[i].run;
+        report(bench, "MB/s", 1e3 / best_of(re, s, 1, &tokens));
+    }
+
+    scan_run = picked;
+    free(s);
+}
+
+int main(int argc, char **argv) {
+    regex_t *re = regex_compile_set(rules, COUNT(rules), 1);
+    if (!re) {
+        fprintf(stderr, "FAIL: rules did not compile\n");
+        return 1;
+    }
+
+    if (!growth(re)) {
+        regex_free(re);
+        return 1;
+    }
+
+    corpus(re, "mixed", mixed, COUNT(mixed));
+    corpus(re, "identifiers", identifiers, COUNT(identifiers));
+    corpus(re, "numbers", numbers, COUNT(numbers));
+    corpus(re, "strings", strings, COUNT(strings));
+    corpus(re, "comments", comments, COUNT(comments));
+
+    compiling();
+    fields();
+    pathological();
+    kernels(re);
+
+    regex_free(re);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    report("rss", "peak_kb", usage.ru_maxrss);
+
+    return 0;
+}
+
+/* vim: set sw=4 et: */
@@ -4,6 +4,136 @@
 
 #include "engine.c"
 
+static regex_t *reload(regex_t *re, char **image) {
+    /* Return a copy of re saved and loaded again, whose image is kept in
+     * *image, or NULL if that didn't work as it should. */
+
+    size_t size = regex_save(re, NULL, 0);
+    *image = malloc(size);
+    if (regex_save(re, *image, size) != size || regex_load(*image, size - 1)) {
+        return NULL;
+    }
+
+    regex_t *loaded = regex_load(*image, size);
+    if (!loaded) {
+        return NULL;
+    }
+
+    char *again = malloc(size);
+    int same = regex_save(loaded, again, size) == size && memcmp(again, *image, size) == 0;
+    free(again);
+
+    if (!same) {
+        regex_free(loaded);
+        return NULL;
+    }
+
+    return loaded;
+}
+
+struct batch {
+    char **inputs;
+    int *expect;
+    int *results;
+    size_t n, size;
+};
+
+static void batch_add(struct batch *b, char const *input, int expect) {
+    if (b->n == b->size) {
+        b->size = b->size ? 2 * b->size : 16;
+        b->inputs = realloc(b->inputs, sizeof(*b->inputs) * b->size);
+        b->expect = realloc(b->expect, sizeof(*b->expect) * b->size);
+        b->results = realloc(b->results, sizeof(*b->results) * b->size);
+    }
+
+    b->inputs[b->n] = strdup(input);
+    b->expect[b->n++] = expect;
+}
+
+static int batch_check(regex_t *re, char const *re_str, struct batch *b) {
+    /* Match every input of b at once, as regex_match does and then as
+     * regex_match_prefix does, and empty b.  Return how many failed. */
+
+    int failed = 0;
+
+    regex_match_many(re, (char const * const *)b->inputs, b->n, b->results);
+    for (size_t i = 0; i < b->n; ++i) {
+        if (b->results[i] != b->expect[i]) {
+            fprintf(stderr, "FAIL: /%s/ in a batch %s %s\n", re_str,
+                    b->expect[i] ? "should match" : "should not match", b->inputs[i]);
+            ++failed;
+        }
+    }
+
+    regex_match_prefix_many(re, (char const * const *)b->inputs, b->n, b->results);
+    for (size_t i = 0; i < b->n; ++i) {
+        if (b->results[i] != regex_match_prefix(re, b->inputs[i])) {
+            fprintf(stderr, "FAIL: /%s/ in a batch matched a prefix of %s wrongly\n", re_str, b->inputs[i]);
+            ++failed;
+        }
+        free(b->inputs[i]);
+    }
+
+    b->n = 0;
+    return failed;
+}
+
+static void unload(regex_t **loaded, char **image) {
+    if (*loaded) {
+        regex_free(*loaded);
+        *loaded = NULL;
+    }
+    free(*image);
+    *image = NULL;
+}
+
+static int shared(regex_t *re, char const *pattern) {
+    /* With SONAVARA_COMPILE_CACHE, compiling pattern again must share re's
+     * automaton, and re must outlive the copy. */
+
+#ifdef SONAVARA_COMPILE_CACHE
+    regex_t *again = regex_compile(pattern);
+    int ok = again && again->insts == re->insts;
+    if (again) {
+        regex_free(again);
+    }
+    return ok;
+#else
+    return 1;
+#endif
+}
+
+static int long_concatenation(void) {
+    /* Compile a literal of a million bytes, which once overflowed the stack
+     * numbering its states, and match it.  Return how many checks failed. */
+
+    size_t n = 1000000;
+    char *s = malloc(n + 1);
+    memset(s, 'a', n);
+    s[n] = 0;
+
+    int failed = 0;
+    regex_t *re = regex_compile(s);
+    if (!re) {
+        fprintf(stderr, "FAIL: a literal of %zu bytes did not compile\n", n);
+        ++failed;
+    } else {
+        if (!regex_match(re, s)) {
+            fprintf(stderr, "FAIL: a literal of %zu bytes should match itself\n", n);
+            ++failed;
+        }
+        s[n - 1] = 0;
+        if (regex_match(re, s)) {
+            fprintf(stderr, "FAIL: a literal of %zu bytes should not match a byte less\n", n);
+            ++failed;
+        }
+        regex_free(re);
+    }
+
+    free(s);
+    return failed;
+}
+
 int main(int argc, char **argv) {
     FILE *f = fopen(argv[1], "r");
     if (!f) {
@@ -16,6 +146,12 @@ int main(int argc, char **argv) {
         warning = 0;
     regex_t *re = NULL;
 
+    /* Everything is also checked against re saved and loaded again, and
+     * each regex's inputs are matched again all together. */
+    regex_t *loaded = NULL;
+    char *image = NULL;
+    struct batch batch = {NULL};
+
     char *re_str;
 
     ssize_t len;
@@ -29,7 +165,9 @@ int main(int argc, char **argv) {
 
         if (strncmp(line, "regex ", 6) == 0) {
             if (re) {
+                failed += batch_check(re, re_str, &batch);
                 regex_free(re);
+                unload(&loaded, &image);
                 free(re_str);
             }
 
@@ -37,13 +175,27 @@ int main(int argc, char **argv) {
             if (!re) {
                 fprintf(stderr, "FAIL: /%s/ did not compile\n", line + 6);
                 ++failed;
+            } else if (!(loaded = reload(re, &image))) {
+                fprintf(stderr, "FAIL: /%s/ did not save and load\n", line + 6);
+                regex_free(re);
+                unload(&loaded, &image);
+                re = NULL;
+                ++failed;
+            } else if (!shared(re, line + 6)) {
+                fprintf(stderr, "FAIL: /%s/ did not share its automaton\n", line + 6);
+                regex_free(re);
+                unload(&loaded, &image);
+                re = NULL;
+                ++failed;
             } else {
                 re_str = strdup(line + 6);
                 ++passed;
             }
         } else if (strncmp(line, "noregex ", 8) == 0) {
             if (re) {
+                failed += batch_check(re, re_str, &batch);
                 regex_free(re);
+                unload(&loaded, &image);
                 free(re_str);
             }
 
@@ -61,24 +213,28 @@ int main(int argc, char **argv) {
                 fprintf(stderr, "WARN: no regular expression for 'match'\n");
                 ++warning;
             } else {
-                if (!regex_match(re, line + 6)) {
+                if (!regex_match(re, line + 6) || !regex_match_n(re, line + 6, len - 6) ||
+                        !regex_match(loaded, line + 6)) {
                     fprintf(stderr, "FAIL: /%s/ should match %s\n", re_str, line + 6);
                     ++failed;
                 } else {
                     ++passed;
                 }
+                batch_add(&batch, line + 6, 1);
             }
         } else if (strncmp(line, "differ ", 7) == 0) {
             if (!re) {
                 fprintf(stderr, "WARN: no regular expression for 'differ'\n");
                 ++warning;
             } else {
-                if (regex_match(re, line + 7)) {
+                if (regex_match(re, line + 7) || regex_match_n(re, line + 7, len - 7) ||
+                        regex_match(loaded, line + 7)) {
                     fprintf(stderr, "FAIL: /%s/ should not match %s\n", re_str, line + 7);
                     ++failed;
                 } else {
                     ++passed;
                 }
+                batch_add(&batch, line + 7, 0);
             }
         } else if (strcmp(line, "matchnewline") == 0) {
             if (!re) {
@@ -113,10 +269,20 @@ int main(int argc, char **argv) {
     fclose(f);
 
     if (re) {
+        failed += batch_check(re, re_str, &batch);
         regex_free(re);
+        unload(&loaded, &image);
         free(re_str);
     }
 
+    int long_failed = long_concatenation();
+    failed += long_failed;
+    passed += !long_failed;
+
+    free(batch.inputs);
+    free(batch.expect);
+    free(batch.results);
+
     if (line) {
         free(line);
     }
@@ -0,0 +1,372 @@
+/* Compiles lexer modes to complete DFAs for the Python generator.
+ *
+ * Reads a sequence of rule sets on stdin, each a line "rules N first" or
+ * "rules N longest" followed by N patterns, one per line.  For each set,
+ * writes "dfa M K N", then a row of the byte class (0 to K - 1) of each byte
+ * 0 to 255, then M rows of "accept t0 t1 ... tK-1", where accept is 0 or one
+ * more than the index of the rule the state accepts for.  State 0 is the dead
+ * state and state 1 the start state.  The DFA is minimal; N is how many
+ * states it had before it was minimised.  On a pattern that fails to compile,
+ * writes "error I" (I being the pattern's index within its set) and exits
+ * non-zero. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Every state must stay in the cache while we enumerate them all; this is
+ * also the most states a generated table can address. */
+#define SONAVARA_DFA_CACHE_STATES 65535
+
+#include "engine.c"
+
+static int dfa_table(regex_t *re, int *nstates, int **next, int **accept) {
+    /* Build every state of re's DFA, and lay it out as a table of
+     * transitions next[state * nclasses + class] and accept values, the
+     * dead state at 0 and the start state at 1.  Return 0 if there are
+     * too many states. */
+
+    struct dstate **states = malloc(sizeof(*states) * SONAVARA_DFA_CACHE_STATES);
+    states[0] = dstate_start(re);
+
+    for (int i = 0; i < re->ndstates; ++i) {
+        struct dstate *d = states[i];
+        for (int c = 0; c < re->nclasses; ++c) {
+            if (d->next[c]) {
+                continue;
+            }
+
+            if (re->ndstates == SONAVARA_DFA_CACHE_STATES) {
+                free(states);
+                return 0;
+            }
+
+            struct dstate *next = dstate_step(re, d, c);
+            states[next->id] = next;
+        }
+    }
+
+    /* Renumber so that the dead state, if we found one, is 0. */
+    int dead = re->ndstates;
+    for (int i = 1; i < re->ndstates; ++i) {
+        if (states[i]->nstates == 0 && !states[i]->match) {
+            dead = i;
+            break;
+        }
+    }
+
+#define DFA_ID(d) ((d)->id == dead ? 0 : (d)->id < dead ? (d)->id + 1 : (d)->id)
+
+    int n = re->ndstates + (dead == re->ndstates),
+        k = re->nclasses;
+    *nstates = n;
+    *next = calloc((size_t)n * k, sizeof(**next));
+    *accept = calloc(n, sizeof(**accept));
+
+    for (int i = 0; i < re->ndstates; ++i) {
+        int id = DFA_ID(states[i]);
+        (*accept)[id] = states[i]->match;
+        for (int c = 0; c < k; ++c) {
+            (*next)[(size_t)id * k + c] = DFA_ID(states[i]->next[c]);
+        }
+    }
+
+#undef DFA_ID
+
+    free(states);
+    return 1;
+}
+
+static int dfa_minimise(int n, int k, int *next, int *accept) {
+    /* Merge the equivalent states of the n-state table dfa_table built, by
+     * Hopcroft's partition refinement, keeping the dead state at 0 and the
+     * start state at 1.  Rewrite the table and return the new number of
+     * states.
+     *
+     * The states of block b are elems[first[b]] onwards for size[b]; those
+     * of states s with a transition on class c to t are
+     * preds[pstart[c * n + t]] up to preds[pstart[c * n + t + 1]]. */
+
+    int *block = malloc(sizeof(int) * n),
+        *elems = malloc(sizeof(int) * n),
+        *pos = malloc(sizeof(int) * n),
+        *first = malloc(sizeof(int) * n),
+        *size = calloc(n, sizeof(int)),
+        *marked = calloc(n, sizeof(int)),
+        *work = malloc(sizeof(int) * n),
+        *inwork = calloc(n, sizeof(int)),
+        *touched = malloc(sizeof(int) * n),
+        *splitter = malloc(sizeof(int) * n),
+        *pstart = calloc((size_t)k * n + 1, sizeof(int)),
+        *preds = malloc(sizeof(int) * (size_t)k * n);
+
+    for (int s = 0; s < n; ++s) {
+        for (int c = 0; c < k; ++c) {
+            ++pstart[(size_t)c * n + next[(size_t)s * k + c] + 1];
+        }
+    }
+    for (size_t i = 0; i < (size_t)k * n; ++i) {
+        pstart[i + 1] += pstart[i];
+    }
+    for (int s = 0; s < n; ++s) {
+        for (int c = 0; c < k; ++c) {
+            preds[pstart[(size_t)c * n + next[(size_t)s * k + c]]++] = s;
+        }
+    }
+    for (size_t i = (size_t)k * n; i > 0; --i) {
+        pstart[i] = pstart[i - 1];
+    }
+    pstart[0] = 0;
+
+    /* Start with a block per accept value. */
+    int nblocks = 0,
+        maxaccept = 0;
+    for (int s = 0; s < n; ++s) {
+        if (accept[s] > maxaccept) {
+            maxaccept = accept[s];
+        }
+    }
+
+    int *initial = malloc(sizeof(int) * (maxaccept + 1));
+    for (int a = 0; a <= maxaccept; ++a) {
+        initial[a] = -1;
+    }
+    for (int s = 0; s < n; ++s) {
+        if (initial[accept[s]] < 0) {
+            initial[accept[s]] = nblocks++;
+        }
+        block[s] = initial[accept[s]];
+        ++size[block[s]];
+    }
+    free(initial);
+
+    for (int b = 0, at = 0; b < nblocks; ++b) {
+        first[b] = at;
+        at += size[b];
+        size[b] = 0;
+    }
+    for (int s = 0; s < n; ++s) {
+        int b = block[s];
+        pos[s] = first[b] + size[b]++;
+        elems[pos[s]] = s;
+    }
+
+    int top = 0;
+    for (int b = 0; b < nblocks; ++b) {
+        work[top++] = b;
+        inwork[b] = 1;
+    }
+
+    while (top) {
+        int b = work[--top],
+            nsplitter = size[b];
+        inwork[b] = 0;
+        memcpy(splitter, &elems[first[b]], sizeof(int) * nsplitter);
+
+        for (int c = 0; c < k; ++c) {
+            int ntouched = 0;
+
+            /* Gather the states leading into the splitter at the front of
+             * their blocks. */
+            for (int j = 0; j < nsplitter; ++j) {
+                size_t t = (size_t)c * n + splitter[j];
+                for (int p = pstart[t]; p < pstart[t + 1]; ++p) {
+                    int s = preds[p],
+                        y = block[s],
+                        to = first[y] + marked[y]++,
+                        other = elems[to];
+
+                    if (to == first[y]) {
+                        touched[ntouched++] = y;
+                    }
+
+                    elems[pos[s]] = other;
+                    pos[other] = pos[s];
+                    elems[to] = s;
+                    pos[s] = to;
+                }
+            }
+
+            for (int j = 0; j < ntouched; ++j) {
+                int y = touched[j];
+
+                if (marked[y] < size[y]) {
+                    int z = nblocks++;
+                    first[z] = first[y];
+                    size[z] = marked[y];
+                    first[y] += marked[y];
+                    size[y] -= marked[y];
+
+                    for (int e = first[z]; e < first[z] + size[z]; ++e) {
+                        block[elems[e]] = z;
+                    }
+
+                    if (inwork[y] || size[z] <= size[y]) {
+                        work[top++] = z;
+                        inwork[z] = 1;
+                    } else {
+                        work[top++] = y;
+                        inwork[y] = 1;
+                    }
+                }
+
+                marked[y] = 0;
+            }
+        }
+    }
+
+    /* Number the blocks, the dead state's and then the start state's
+     * first.  If the start state is dead, it's kept as a copy. */
+    int *id = malloc(sizeof(int) * nblocks),
+        *rep = malloc(sizeof(int) * (nblocks + 1)),
+        m = 0;
+    for (int b = 0; b < nblocks; ++b) {
+        id[b] = -1;
+    }
+
+    id[block[0]] = m;
+    rep[m++] = 0;
+    if (block[1] == block[0]) {
+        rep[m++] = 0;
+    }
+    for (int s = 1; s < n; ++s) {
+        if (id[block[s]] < 0) {
+            id[block[s]] = m;
+            rep[m++] = s;
+        }
+    }
+
+    int *minimal = malloc(sizeof(int) * (size_t)m * k),
+        *minimal_accept = malloc(sizeof(int) * m);
+    for (int j = 0; j < m; ++j) {
+        minimal_accept[j] = accept[rep[j]];
+        for (int c = 0; c < k; ++c) {
+            minimal[(size_t)j * k + c] = id[block[next[(size_t)rep[j] * k + c]]];
+        }
+    }
+    memcpy(next, minimal, sizeof(int) * (size_t)m * k);
+    memcpy(accept, minimal_accept, sizeof(int) * m);
+
+    free(minimal);
+    free(minimal_accept);
+    free(id);
+    free(rep);
+    free(block);
+    free(elems);
+    free(pos);
+    free(first);
+    free(size);
+    free(marked);
+    free(work);
+    free(inwork);
+    free(touched);
+    free(splitter);
+    free(pstart);
+    free(preds);
+
+    return m;
+}
+
+static int dfa_dump(regex_t *re, FILE *out) {
+    int n, *next, *accept;
+    if (!dfa_table(re, &n, &next, &accept)) {
+        return 0;
+    }
+
+    int k = re->nclasses,
+        m = dfa_minimise(n, k, next, accept);
+
+    fprintf(out, "dfa %d %d %d\n", m, k, n);
+
+    for (int c = 0; c < 256; ++c) {
+        fprintf(out, c ? " %d" : "%d", re->classes[c]);
+    }
+    fprintf(out, "\n");
+
+    for (int i = 0; i < m; ++i) {
+        fprintf(out, "%d", accept[i]);
+        for (int c = 0; c < k; ++c) {
+            fprintf(out, " %d", next[(size_t)i * k + c]);
+        }
+        fprintf(out, "\n");
+    }
+
+    free(next);
+    free(accept);
+    return 1;
+}
+
+static char *read_line(FILE *in) {
+    ssize_t len;
+    char *line = NULL;
+    size_t linecap = 0;
+
+    if ((len = getline(&line, &linecap, in)) <= 0) {
+        free(line);
+        return NULL;
+    }
+
+    if (line[len - 1] == '\n') {
+        line[len - 1] = 0;
+    }
+
+    return line;
+}
+
+static int compile_rules(FILE *in, FILE *out, int n, int first) {
+    char **patterns = malloc(sizeof(*patterns) * n);
+    for (int i = 0; i < n; ++i) {
+        patterns[i] = read_line(in);
+        if (!patterns[i]) {
+            return 0;
+        }
+    }
+
+    regex_t *re = regex_compile_set((char const * const *)patterns, n, first);
+    int ok = re && dfa_dump(re, out);
+
+    if (!re) {
+        /* Find the culprit. */
+        for (int i = 0; i < n; ++i) {
+            regex_t *single = regex_compile(patterns[i]);
+            if (!single) {
+                fprintf(out, "error %d\n", i);
+                break;
+            }
+            regex_free(single);
+        }
+    }
+
+    if (re) {
+        regex_free(re);
+    }
+
+    for (int i = 0; i < n; ++i) {
+        free(patterns[i]);
+    }
+    free(patterns);
+
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    char *line;
+
+    while ((line = read_line(stdin))) {
+        int n;
+        char priority[8];
+
+        if (sscanf(line, "rules %d %7s", &n, priority) != 2 || n < 1) {
+            return 1;
+        }
+        free(line);
+
+        if (!compile_rules(stdin, stdout, n, strcmp(priority, "first") == 0)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* vim: set sw=4 et: */
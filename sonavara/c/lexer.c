@@ -1,96 +1,819 @@
 #include <stdlib.h>
 #include <string.h>
 
-#ifndef SONAVARA_NO_SELF_CHAIN
-#include "engine.c"
+#if defined(SONAVARA_INCLUDE_FILE) || defined(SONAVARA_STATS)
+#include <stdio.h>
+#endif
+
+#ifdef SONAVARA_PARALLEL
+#include <pthread.h>
 #endif
 
-#define BEGIN(r) current_rules = rules_##r
-#define END() current_rules = rules
+/* Actions switch the mode of the lexer they were called for. */
+#define BEGIN(r) _lexer->mode = &lexer_mode_##r
+#define END() _lexer->mode = &lexer_mode
+
+struct lexer;
 
+/* With SONAVARA_MATCH_SPAN, actions see the match in place in the source,
+ * as a pointer and length; otherwise they get a NUL-terminated copy.  When
+ * lexing a file, a span is only good until the next call to lexer_lex. */
 struct lexer_rule {
     char const *pattern;
-    int (*action)(char *match, void *_context, int *_skip);
+#ifdef SONAVARA_MATCH_SPAN
+    int (*action)(char const *match, size_t match_len, void *_context, int *_skip, struct lexer *_lexer);
+#else
+    int (*action)(char *match, void *_context, int *_skip, struct lexer *_lexer);
+#endif
+};
 
-    struct regex *re;
+/* All of a mode's rules are compiled by the generator into one DFA.  State 0
+ * is the dead state and state 1 the start state.  Transitions are on byte
+ * classes: the state after reading c is dfa[state * nclasses + classes[c]].
+ * accept[state] is 0, or one more than the index of the rule that wins if the
+ * token ends there.  If loop[state] isn't 0, the state loops on itself on the
+ * bytes in the scan.c set loops[loop[state] - 1].
+ *
+ * With SONAVARA_DIRECT_CODE, the generator instead emits the DFA as code: scan
+ * behaves as lexer_mode_match below.  name is NULL for the default mode. */
+struct lexer_mode {
+#ifdef SONAVARA_DIRECT_CODE
+    int (*scan)(char const *s, char const *end, int *rule, int *partial, size_t *scanned);
+#else
+    unsigned char const *classes;
+    int nclasses;
+    unsigned short const *dfa;
+    unsigned short const *accept;
+    unsigned short const *loop;
+    unsigned char const (*loops)[32];
+#endif
+    struct lexer_rule const *rules;
+    char const *name;
 };
 
-extern struct lexer_rule *current_rules;
-extern struct lexer_rule rules[];
+extern struct lexer_mode const lexer_mode;
+
+/* Every mode, the default first, then NULL. */
+extern struct lexer_mode const *const lexer_modes[];
 
+struct lexer_parallel;
+struct lexer_stats;
+
+/* Everything that changes as a lexer runs is here, and the modes are
+ * constant, so lexers can run on as many threads as there are lexers.  mode
+ * is the current mode.
+ *
+ * The input yet to be lexed is src up to end.  A lexer reading a file holds
+ * a window of it in buffer, which lexer_refill slides along; buffer is only
+ * ever grown past SONAVARA_BUFFER_SIZE to hold a single token larger than
+ * that.  A lexer started by lexer_start_path instead has the whole file
+ * mapped at map.  With SONAVARA_PARALLEL, parallel is set once lexer_parallel
+ * has set threads lexing ahead.  With SONAVARA_STATS, stats holds the
+ * lexer's counts once it has any.  With SONAVARA_INCREMENTAL, token is where
+ * the last token matched started, and reach is one past the furthest byte
+ * the lexer has read. */
 struct lexer {
+    struct lexer_mode const *mode;
     char const *src;
+    char const *end;
     char *buffer;
+#ifdef SONAVARA_INCLUDE_FILE
+    size_t buffersz;
+    FILE *file;
+    int fd;
+    void *map;
+    size_t mapsz;
+#endif
+#ifdef SONAVARA_PARALLEL
+    struct lexer_parallel *parallel;
+#endif
+#ifdef SONAVARA_STATS
+    struct lexer_stats *stats;
+#endif
+#ifdef SONAVARA_INCREMENTAL
+    char const *token;
+    char const *reach;
+#endif
 };
 
-static int lexer_init(struct lexer_rule *rules) {
-    for (struct lexer_rule *rule = rules; rule->pattern; ++rule) {
-        if (rule->re) {
-            return 1;
+static int lexer_mode_match(struct lexer_mode const *mode, char const *s, char const *end, int *rule, int *partial, size_t *scanned) {
+    /* Return the length of the token at s, storing the index of the rule
+     * that matched it in *rule, or -1 if no rule matches.  If the scan ran
+     * into end before the DFA died, more input could give a longer token,
+     * and *partial is set.  *scanned is set to how many bytes the DFA read. */
+
+#ifdef SONAVARA_DIRECT_CODE
+    return mode->scan(s, end, rule, partial, scanned);
+#else
+    char const *start = s;
+    unsigned short state = 1;
+    int longest_match = -1;
+
+    for (; s < end; ++s) {
+        state = mode->dfa[state * mode->nclasses + mode->classes[(unsigned char)*s]];
+        if (!state) {
+            *scanned = s + 1 - start;
+            return longest_match;
+        }
+
+        /* Skip the run of bytes that keeps us here, if there is one. */
+        if (mode->loop[state] && s + 1 < end &&
+                scan_set_contains(mode->loops[mode->loop[state] - 1], (unsigned char)s[1])) {
+            s = scan_run(mode->loops[mode->loop[state] - 1], s + 2, end) - 1;
+        }
+
+        if (mode->accept[state]) {
+            longest_match = s + 1 - start;
+            *rule = mode->accept[state] - 1;
+        }
+    }
+
+    *partial = 1;
+    *scanned = s - start;
+    return longest_match;
+#endif
+}
+
+#ifdef SONAVARA_PARALLEL
+
+/* lexer_parallel splits the input into windows of SONAVARA_CHUNK_SIZE bytes
+ * per thread, and has a thread lex each chunk of a window from the chunk's
+ * start in every mode, noting the tokens it finds but running no actions.
+ * lexer_lex still runs every action in turn on its own thread, but where a
+ * chunk has a token starting just where it is, in the mode it's in, it takes
+ * that instead of scanning: lexing from there can only find the same token.
+ * A chunk's guesses usually fall in step with the real tokens within a few
+ * tokens of its start.  While lexer_lex works through one window, the
+ * threads lex the next. */
+
+#ifndef SONAVARA_CHUNK_SIZE
+#define SONAVARA_CHUNK_SIZE (1 << 20)
+#endif
+
+/* start is an offset into the input. */
+struct lexer_token {
+    size_t start;
+    int len;
+    int rule;
+};
+
+/* The tokens starting from start up to stop found in each mode.  Where no
+ * rule matched, lexing carries on from the next byte.  next[m] is how far
+ * lexer_lex has looked in tokens[m]. */
+struct lexer_chunk {
+    char const *base, *end;
+    size_t start, stop;
+    struct lexer_token **tokens;
+    size_t *ntokens, *next, *cap;
+};
+
+/* index is which window this is, counting from the start of the input. */
+struct lexer_window {
+    size_t index;
+    int running;
+    pthread_t *threads;
+    int *started;
+    struct lexer_chunk *chunks;
+};
+
+/* chunk is the one lexer_lex is in, and m the index of mode in
+ * lexer_modes. */
+struct lexer_parallel {
+    char const *base;
+    size_t len;
+    int nthreads;
+    int nmodes;
+    struct lexer_window windows[2];
+    struct lexer_chunk *chunk;
+    struct lexer_mode const *mode;
+    int m;
+};
+
+static void *lexer_chunk_scan(void *arg) {
+    struct lexer_chunk *chunk = arg;
+
+    for (int m = 0; lexer_modes[m]; ++m) {
+        char const *s = chunk->base + chunk->start;
+        chunk->ntokens[m] = chunk->next[m] = 0;
+
+        while (s < chunk->base + chunk->stop) {
+            int rule, partial = 0;
+            size_t scanned;
+            int len = lexer_mode_match(lexer_modes[m], s, chunk->end, &rule, &partial, &scanned);
+            if (len <= 0) {
+                ++s;
+                continue;
+            }
+
+            if (chunk->ntokens[m] == chunk->cap[m]) {
+                chunk->cap[m] = chunk->cap[m] ? 2 * chunk->cap[m] : 256;
+                chunk->tokens[m] = realloc(chunk->tokens[m], sizeof(**chunk->tokens) * chunk->cap[m]);
+            }
+
+            struct lexer_token *token = &chunk->tokens[m][chunk->ntokens[m]++];
+            token->start = s - chunk->base;
+            token->len = len;
+            token->rule = rule;
+            s += len;
+        }
+    }
+
+    return NULL;
+}
+
+static void lexer_window_wait(struct lexer_parallel *parallel, struct lexer_window *window) {
+    if (!window->running) {
+        return;
+    }
+
+    for (int i = 0; i < parallel->nthreads; ++i) {
+        if (window->started[i]) {
+            pthread_join(window->threads[i], NULL);
+        }
+    }
+    window->running = 0;
+}
+
+static void lexer_window_start(struct lexer_parallel *parallel, struct lexer_window *window, size_t index) {
+    lexer_window_wait(parallel, window);
+
+    window->index = index;
+    window->running = 1;
+
+    for (int i = 0; i < parallel->nthreads; ++i) {
+        struct lexer_chunk *chunk = &window->chunks[i];
+        size_t start = (index * parallel->nthreads + i) * (size_t)SONAVARA_CHUNK_SIZE;
+        chunk->start = start < parallel->len ? start : parallel->len;
+        chunk->stop = parallel->len - chunk->start > SONAVARA_CHUNK_SIZE ?
+            chunk->start + SONAVARA_CHUNK_SIZE : parallel->len;
+
+        /* Without a thread, the chunk is lexed here and now. */
+        window->started[i] = pthread_create(&window->threads[i], NULL, lexer_chunk_scan, chunk) == 0;
+        if (!window->started[i]) {
+            lexer_chunk_scan(chunk);
+        }
+    }
+}
+
+static int lexer_parallel_match(struct lexer *lexer, int *rule) {
+    /* Return the length of the token a thread found at lexer->src in its
+     * mode, storing its rule in *rule, or -1 if there isn't one. */
+
+    struct lexer_parallel *parallel = lexer->parallel;
+    size_t pos = lexer->src - parallel->base;
+
+    if (!parallel->chunk || pos >= parallel->chunk->stop) {
+        size_t size = (size_t)SONAVARA_CHUNK_SIZE * parallel->nthreads,
+               index = pos / size;
+
+        struct lexer_window *window = &parallel->windows[index % 2],
+                            *ahead = &parallel->windows[(index + 1) % 2];
+        if (window->index != index) {
+            lexer_window_start(parallel, window, index);
         }
+        if (ahead->index != index + 1 && (index + 1) * size < parallel->len) {
+            lexer_window_start(parallel, ahead, index + 1);
+        }
+        lexer_window_wait(parallel, window);
+
+        parallel->chunk = &window->chunks[(pos - index * size) / SONAVARA_CHUNK_SIZE];
+    }
+
+    if (parallel->mode != lexer->mode) {
+        int m = 0;
+        while (lexer_modes[m] && lexer_modes[m] != lexer->mode) {
+            ++m;
+        }
+        if (!lexer_modes[m]) {
+            return -1;
+        }
+
+        parallel->mode = lexer->mode;
+        parallel->m = m;
+    }
+
+    struct lexer_chunk *chunk = parallel->chunk;
+    int m = parallel->m;
+    while (chunk->next[m] < chunk->ntokens[m] && chunk->tokens[m][chunk->next[m]].start < pos) {
+        ++chunk->next[m];
+    }
+
+    if (chunk->next[m] == chunk->ntokens[m] || chunk->tokens[m][chunk->next[m]].start != pos) {
+        return -1;
+    }
+
+    *rule = chunk->tokens[m][chunk->next[m]].rule;
+    return chunk->tokens[m][chunk->next[m]].len;
+}
+
+int lexer_parallel(struct lexer *lexer, int nthreads) {
+    /* Have nthreads threads lex ahead of lexer_lex, which must not have
+     * been called yet.  The lexer must be lexing memory or a mapped file.
+     * Return 0 if it can't be done. */
 
-        rule->re = regex_compile(rule->pattern);
-        if (!rule->re) {
-            return 0;
+#ifdef SONAVARA_INCLUDE_FILE
+    if (lexer->buffersz) {
+        return 0;
+    }
+#endif
+    if (nthreads < 1 || lexer->parallel) {
+        return 0;
+    }
+
+    struct lexer_parallel *parallel = calloc(1, sizeof(*parallel));
+    parallel->base = lexer->src;
+    parallel->len = lexer->end - lexer->src;
+    parallel->nthreads = nthreads;
+    while (lexer_modes[parallel->nmodes]) {
+        ++parallel->nmodes;
+    }
+
+    for (int w = 0; w < 2; ++w) {
+        struct lexer_window *window = &parallel->windows[w];
+        window->index = (size_t)-1;
+        window->threads = calloc(nthreads, sizeof(*window->threads));
+        window->started = calloc(nthreads, sizeof(*window->started));
+        window->chunks = calloc(nthreads, sizeof(*window->chunks));
+
+        for (int i = 0; i < nthreads; ++i) {
+            struct lexer_chunk *chunk = &window->chunks[i];
+            chunk->base = parallel->base;
+            chunk->end = lexer->end;
+            chunk->tokens = calloc(parallel->nmodes, sizeof(*chunk->tokens));
+            chunk->ntokens = calloc(parallel->nmodes, sizeof(*chunk->ntokens));
+            chunk->next = calloc(parallel->nmodes, sizeof(*chunk->next));
+            chunk->cap = calloc(parallel->nmodes, sizeof(*chunk->cap));
         }
     }
+
+    lexer->parallel = parallel;
     return 1;
 }
 
-static int lexer_init_all();
+static void lexer_parallel_free(struct lexer_parallel *parallel) {
+    for (int w = 0; w < 2; ++w) {
+        struct lexer_window *window = &parallel->windows[w];
+        lexer_window_wait(parallel, window);
 
-struct lexer *lexer_start_str(char const *src) {
-    if (!lexer_init_all()) {
-        return NULL;
+        for (int i = 0; i < parallel->nthreads; ++i) {
+            struct lexer_chunk *chunk = &window->chunks[i];
+            for (int m = 0; m < parallel->nmodes; ++m) {
+                free(chunk->tokens[m]);
+            }
+            free(chunk->tokens);
+            free(chunk->ntokens);
+            free(chunk->next);
+            free(chunk->cap);
+        }
+
+        free(window->threads);
+        free(window->started);
+        free(window->chunks);
+    }
+
+    free(parallel);
+}
+
+#endif
+
+static int lexer_match(struct lexer *lexer, int *rule, int *partial, size_t *scanned) {
+    /* Match the next token as lexer_mode_match does in lexer's mode. */
+
+#ifdef SONAVARA_PARALLEL
+    if (lexer->parallel && lexer->src < lexer->end) {
+        int len = lexer_parallel_match(lexer, rule);
+        if (len > 0) {
+            *scanned = len;
+            return len;
+        }
+    }
+#endif
+
+#ifdef SONAVARA_INCREMENTAL
+    lexer->token = lexer->src;
+    int len = lexer_mode_match(lexer->mode, lexer->src, lexer->end, rule, partial, scanned);
+    if (lexer->src + *scanned > lexer->reach) {
+        lexer->reach = lexer->src + *scanned;
+    }
+    return len;
+#else
+    return lexer_mode_match(lexer->mode, lexer->src, lexer->end, rule, partial, scanned);
+#endif
+}
+
+#ifdef SONAVARA_STATS
+
+/* For each mode, in the order of lexer_modes: how many times the lexer
+ * looked for a token, and how many bytes the DFA read doing so; wasted is
+ * those bytes that weren't part of the token found, if any.  A search that
+ * ran into the end of the buffer and was tried again counts twice.  For
+ * each of the mode's rules: how many tokens it matched, and of how many
+ * bytes. */
+struct lexer_rule_stats {
+    unsigned long tokens;
+    unsigned long bytes;
+};
+
+struct lexer_mode_stats {
+    unsigned long attempts;
+    unsigned long scanned;
+    unsigned long wasted;
+    int nrules;
+    struct lexer_rule_stats *rules;
+};
+
+struct lexer_stats {
+    int nmodes;
+    struct lexer_mode_stats *modes;
+};
+
+struct lexer_stats const *lexer_stats(struct lexer *lexer) {
+    if (!lexer->stats) {
+        struct lexer_stats *stats = calloc(1, sizeof(*stats));
+        while (lexer_modes[stats->nmodes]) {
+            ++stats->nmodes;
+        }
+
+        stats->modes = calloc(stats->nmodes, sizeof(*stats->modes));
+        for (int m = 0; m < stats->nmodes; ++m) {
+            struct lexer_mode_stats *mode = &stats->modes[m];
+            while (lexer_modes[m]->rules[mode->nrules].pattern) {
+                ++mode->nrules;
+            }
+            mode->rules = calloc(mode->nrules, sizeof(*mode->rules));
+        }
+
+        lexer->stats = stats;
+    }
+
+    return lexer->stats;
+}
+
+void lexer_stats_write(struct lexer *lexer, FILE *out) {
+    /* Write a report of lexer's counts to out, mode by mode. */
+
+    struct lexer_stats const *stats = lexer_stats(lexer);
+
+    for (int m = 0; m < stats->nmodes; ++m) {
+        struct lexer_mode_stats const *mode = &stats->modes[m];
+        fprintf(out, "%s: %lu attempts; %lu bytes read, %lu wasted\n",
+                lexer_modes[m]->name ? lexer_modes[m]->name : "default mode",
+                mode->attempts, mode->scanned, mode->wasted);
+
+        for (int r = 0; r < mode->nrules; ++r) {
+            fprintf(out, "    rule %d: %lu tokens, %lu bytes: %s\n", r,
+                    mode->rules[r].tokens, mode->rules[r].bytes, lexer_modes[m]->rules[r].pattern);
+        }
+    }
+}
+
+static void lexer_stats_free(struct lexer_stats *stats) {
+    for (int m = 0; m < stats->nmodes; ++m) {
+        free(stats->modes[m].rules);
+    }
+    free(stats->modes);
+    free(stats);
+}
+
+#endif
+
+static void lexer_count(struct lexer *lexer, int rule, int len, size_t scanned) {
+    /* Count a search for a token in lexer's mode that read scanned bytes and
+     * found rule's token of len bytes, or none if rule is -1.  Without
+     * SONAVARA_STATS, do nothing. */
+
+#ifdef SONAVARA_STATS
+    struct lexer_stats const *stats = lexer_stats(lexer);
+
+    int m = 0;
+    while (m < stats->nmodes && lexer_modes[m] != lexer->mode) {
+        ++m;
+    }
+    if (m == stats->nmodes) {
+        return;
+    }
+
+    struct lexer_mode_stats *mode = &stats->modes[m];
+    ++mode->attempts;
+    mode->scanned += scanned;
+
+    if (rule < 0) {
+        mode->wasted += scanned;
+    } else {
+        mode->wasted += scanned - len;
+        ++mode->rules[rule].tokens;
+        mode->rules[rule].bytes += len;
     }
+#endif
+}
 
-    current_rules = rules;
+struct lexer *lexer_start_mem(void const *src, size_t len) {
+    /* Lex the len bytes at src in place.  They may include NULs, though
+     * actions that take a copy of their match will see it cut short. */
 
-    struct lexer *lexer = malloc(sizeof(*lexer));
+    struct lexer *lexer = calloc(1, sizeof(*lexer));
+    lexer->mode = &lexer_mode;
     lexer->src = src;
-    lexer->buffer = NULL;
+    lexer->end = lexer->src + len;
     return lexer;
 }
 
+struct lexer *lexer_start_str(char const *src) {
+    return lexer_start_mem(src, strlen(src));
+}
+
 #ifdef SONAVARA_INCLUDE_FILE
 
-#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef SONAVARA_BUFFER_SIZE
+#define SONAVARA_BUFFER_SIZE 65536
+#endif
+
+struct lexer *lexer_start_fd(int fd) {
+    struct lexer *lexer = lexer_start_str("");
+    lexer->buffersz = SONAVARA_BUFFER_SIZE;
+    lexer->buffer = malloc(lexer->buffersz);
+    lexer->src = lexer->end = lexer->buffer;
+    lexer->fd = fd;
+    return lexer;
+}
 
 struct lexer *lexer_start_file(FILE *file) {
-    int buffersz = 2;
-    int n = 0;
-    char *buffer = malloc(buffersz);
+    struct lexer *lexer = lexer_start_fd(-1);
+    lexer->file = file;
+    return lexer;
+}
 
-    while (!feof(file)) {
-        if (n == buffersz - 1) {
-            buffersz *= 2;
-            char *newbuffer = malloc(buffersz);
-            memcpy(newbuffer, buffer, n);
-            free(buffer);
-            buffer = newbuffer;
-        }
+struct lexer *lexer_start_path(char const *path) {
+    /* Map the file at path and lex it in place.  Return NULL if it can't be
+     * opened or mapped. */
 
-        size_t r = fread(buffer + n, 1, buffersz - n - 1, file);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
 
-        if (r <= 0) {
-            break;
-        }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
 
-        n += r;
+    if (st.st_size == 0) {
+        close(fd);
+        return lexer_start_mem("", 0);
     }
 
-    buffer[n] = 0;
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
 
-    struct lexer *lexer = lexer_start_str(buffer);
-    lexer->buffer = buffer;
+    struct lexer *lexer = lexer_start_mem(map, st.st_size);
+    lexer->map = map;
+    lexer->mapsz = st.st_size;
     return lexer;
 }
-#endif
 
+static int lexer_refill(struct lexer *lexer) {
+    /* Keep the unlexed input, move it to the front of the buffer and read
+     * more after it.  Return 0 at the end of the input. */
+
+    if (!lexer->buffersz) {
+        return 0;
+    }
+
+    size_t n = lexer->end - lexer->src;
+
+    if (n == lexer->buffersz) {
+        lexer->buffersz *= 2;
+        char *buffer = malloc(lexer->buffersz);
+        memcpy(buffer, lexer->src, n);
+        free(lexer->buffer);
+        lexer->buffer = buffer;
+    } else if (lexer->src != lexer->buffer) {
+        memmove(lexer->buffer, lexer->src, n);
+    }
+
+    lexer->src = lexer->buffer;
+    lexer->end = lexer->buffer + n;
+
+    ssize_t r;
+    if (lexer->file) {
+        r = fread(lexer->buffer + n, 1, lexer->buffersz - n, lexer->file);
+    } else {
+        do {
+            r = read(lexer->fd, lexer->buffer + n, lexer->buffersz - n);
+        } while (r < 0 && errno == EINTR);
+    }
+
+    if (r <= 0) {
+        return 0;
+    }
+
+    lexer->end += r;
+    return 1;
+}
+
+#else
+
+static int lexer_refill(struct lexer *lexer) {
+    return 0;
+}
+
+#endif
 
 void lexer_free(struct lexer *lexer) {
+#ifdef SONAVARA_STATS
+    if (lexer->stats) {
+        lexer_stats_free(lexer->stats);
+    }
+#endif
+#ifdef SONAVARA_PARALLEL
+    if (lexer->parallel) {
+        lexer_parallel_free(lexer->parallel);
+    }
+#endif
+#ifdef SONAVARA_INCLUDE_FILE
+    if (lexer->map) {
+        munmap(lexer->map, lexer->mapsz);
+    }
+#endif
     free(lexer->buffer);
     free(lexer);
 }
 
+#ifdef SONAVARA_INCREMENTAL
+
+/* A token as lexer_lex_all records it: lexer_lex returned token for the
+ * bytes from start to end, leaving the lexer in lexer_modes[mode], having
+ * read up to reach.  Offsets are from the start of the buffer. */
+struct lexer_lexeme {
+    size_t start;
+    size_t end;
+    size_t reach;
+    int token;
+    int mode;
+};
+
+/* Every token in a buffer, and what lexer_lex returned after the last: 0 at
+ * the end, or -1 where nothing matched.  lexer_relex replaced relexed of the
+ * tokens from first the last time it ran. */
+struct lexer_lexemes {
+    struct lexer_lexeme *tokens;
+    size_t n;
+    size_t cap;
+    int last;
+    size_t first;
+    size_t relexed;
+};
+
+/* The generated lexer_lex, taking context whether it wants one or not. */
+static int lexer_lex_any(struct lexer *lexer, void *context);
+
+static void lexer_lexemes_add(struct lexer_lexemes *lexemes, struct lexer_lexeme const *lexeme) {
+    if (lexemes->n == lexemes->cap) {
+        lexemes->cap = lexemes->cap ? lexemes->cap * 2 : 64;
+        lexemes->tokens = realloc(lexemes->tokens, sizeof(*lexemes->tokens) * lexemes->cap);
+    }
+    lexemes->tokens[lexemes->n++] = *lexeme;
+}
+
+static int lexer_lex_lexeme(struct lexer *lexer, char const *base, void *context, struct lexer_lexeme *lexeme) {
+    /* Lex a token as lexer_lex does, and fill in lexeme from it. */
+
+    int t = lexer_lex_any(lexer, context);
+    if (t > 0) {
+        lexeme->start = lexer->token - base;
+        lexeme->end = lexer->src - base;
+        lexeme->reach = lexer->reach - base;
+        lexeme->token = t;
+        lexeme->mode = 0;
+        while (lexer_modes[lexeme->mode] != lexer->mode) {
+            ++lexeme->mode;
+        }
+    }
+    return t;
+}
+
+struct lexer_lexemes *lexer_lex_all(char const *src, size_t len, void *context) {
+    /* Lex the len bytes at src, recording every token for lexer_relex.
+     * context is passed on to lexer_lex if it takes one. */
+
+    struct lexer_lexemes *lexemes = calloc(1, sizeof(*lexemes));
+    struct lexer *lexer = lexer_start_mem(src, len);
+    lexer->reach = lexer->src;
+
+    struct lexer_lexeme lexeme;
+    while ((lexemes->last = lexer_lex_lexeme(lexer, src, context, &lexeme)) > 0) {
+        lexer_lexemes_add(lexemes, &lexeme);
+    }
+
+    lexer_free(lexer);
+    lexemes->relexed = lexemes->n;
+    return lexemes;
+}
+
+void lexer_relex(struct lexer_lexemes *lexemes, char const *src, size_t len, size_t offset, size_t deleted, size_t inserted, void *context) {
+    /* Bring lexemes up to date with an edit to their buffer, which is now
+     * the len bytes at src: deleted bytes at offset were replaced with the
+     * inserted bytes now there.
+     *
+     * Tokens found without reading as far as offset still stand, so lexing
+     * starts again after the last of them, in the mode it left.  Once a new
+     * token ends past the edit where an old one did, in the same mode, the
+     * rest of the old tokens follow from the same bytes and are kept.
+     * Actions run again only for the tokens in between, so they mustn't
+     * keep state in context that later tokens depend on. */
+
+    struct lexer_lexeme *old = lexemes->tokens;
+    size_t n = lexemes->n;
+
+    /* Reach never falls from one token to the next. */
+    size_t lo = 0, hi = n;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (old[mid].reach < offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    size_t first = lo;
+
+    struct lexer *lexer = lexer_start_mem(src, len);
+    lexer->reach = lexer->src;
+    if (first) {
+        lexer->src += old[first - 1].end;
+        lexer->mode = lexer_modes[old[first - 1].mode];
+        lexer->reach += old[first - 1].reach;
+    }
+
+    /* An old offset from offset + deleted on, plus inserted, is the same
+     * byte's new offset plus deleted; comparing so never wraps. */
+    struct lexer_lexemes fresh = {NULL};
+    size_t next = first;
+    int t;
+
+    struct lexer_lexeme lexeme;
+    while ((t = lexer_lex_lexeme(lexer, src, context, &lexeme)) > 0) {
+        lexer_lexemes_add(&fresh, &lexeme);
+
+        if (lexeme.end < offset + inserted) {
+            continue;
+        }
+
+        while (next < n && old[next].end + inserted < lexeme.end + deleted) {
+            ++next;
+        }
+        if (next < n && old[next].end + inserted == lexeme.end + deleted && old[next].mode == lexeme.mode &&
+                old[next].end >= offset + deleted) {
+            break;
+        }
+    }
+    lexer_free(lexer);
+
+    /* Keep the old tokens after next, moved by the edit, or none if lexing
+     * ran to the end.  They all start past the deleted bytes. */
+    size_t kept = t > 0 ? n - next - 1 : 0;
+    size_t total = first + fresh.n + kept;
+    if (total > lexemes->cap) {
+        lexemes->cap = total;
+        lexemes->tokens = old = realloc(old, sizeof(*old) * total);
+    }
+
+    memmove(old + first + fresh.n, old + n - kept, sizeof(*old) * kept);
+    for (size_t i = first + fresh.n; i < total; ++i) {
+        old[i].start = old[i].start - deleted + inserted;
+        old[i].end = old[i].end - deleted + inserted;
+        old[i].reach = old[i].reach - deleted + inserted;
+    }
+    if (fresh.n) {
+        memcpy(old + first, fresh.tokens, sizeof(*old) * fresh.n);
+    }
+    free(fresh.tokens);
+
+    lexemes->n = total;
+    if (t <= 0) {
+        lexemes->last = t;
+    }
+    lexemes->first = first;
+    lexemes->relexed = fresh.n;
+}
+
+void lexer_lexemes_free(struct lexer_lexemes *lexemes) {
+    free(lexemes->tokens);
+    free(lexemes);
+}
+
+#endif
+
 /* vim: set sw=4 et: */
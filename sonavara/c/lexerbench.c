@@ -0,0 +1,82 @@
+#include <stdio.h>
+#include <time.h>
+#include <sys/resource.h>
+
+/* Times lexer_lex end to end on a lexer generated from lexerbench.rules, which
+ * LEXER names, in the style STYLE names, and prints tab-separated lines as
+ * enginebench does. */
+
+#include LEXER
+
+static char const *words[] = {
+    "int", "x", "=", "42", ";", "\n", "while", "(", "counter", ")",
+    "{", "}", "\"a string literal\"", "+", "identifier_0", "  ",
+    "3.14159", "0x7fffffff", "\"with \\\"escapes\\\" in\"", "/* a comment */",
+    "// to the end of the line\n", "a_rather_long_identifier_name_0",
+};
+
+static char *source(size_t size) {
+    /* Return at least size bytes of words, each followed by a space. */
+
+    char *s = malloc(size + 64);
+    size_t n = 0;
+    unsigned r = 1;
+
+    while (n < size) {
+        r = r * 1103515245 + 12345;
+        char const *w = words[(r >> 16) % (sizeof(words) / sizeof(*words))];
+        size_t len = strlen(w);
+        memcpy(s + n, w, len);
+        n += len;
+        s[n++] = ' ';
+    }
+
+    s[n] = 0;
+    return s;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void) {
+    char *s = source(1 << 24);
+    size_t len = strlen(s), tokens = 0;
+    double best = 0;
+
+    for (int i = 0; i < 4; ++i) {
+        struct lexer *lexer = lexer_start_mem(s, len);
+        double start = now();
+
+        int t;
+        tokens = 0;
+        while ((t = lexer_lex(lexer)) > 0) {
+            ++tokens;
+        }
+        double elapsed = now() - start;
+
+        if (t < 0 || lexer->src != lexer->end) {
+            fprintf(stderr, "FAIL: no token at %.16s\n", lexer->src);
+            return 1;
+        }
+        lexer_free(lexer);
+
+        if (!best || elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    printf("lexer/%s\tMB/s\t%.2f\n", STYLE, len / best / 1e6);
+    printf("lexer/%s\tns/token\t%.2f\n", STYLE, best * 1e9 / tokens);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("lexer/%s/rss\tpeak_kb\t%.2f\n", STYLE, (double)usage.ru_maxrss);
+
+    free(s);
+    return 0;
+}
+
+/* vim: set sw=4 et: */
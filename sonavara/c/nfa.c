@@ -5,13 +5,23 @@
 #include <string.h>
 
 #ifndef SONAVARA_NO_SELF_CHAIN
+#include "arena.c"
 #include "tokeniser.c"
 #endif
 
+/* A counted repetition is a STATE_REPEAT, which enters its body at o1 or, if
+ * low is 0, skips it for o2, and a STATE_COUNT at the end of the body, which
+ * goes round again at o1 or leaves for o2 according to how many iterations
+ * there have been.  Each is the other's partner.  Only bodies free of
+ * counted repetitions of their own are counted; the engines keep the
+ * iteration count with each thread. */
 enum state_type {
     STATE_ATOM,
     STATE_SPLIT,
     STATE_MATCH,
+    STATE_REPEAT,
+    STATE_COUNT,
+    STATE_BRANCH,
     STATE_MARK
 };
 
@@ -19,8 +29,36 @@ struct state {
     enum state_type type;
     union {
         unsigned char atom[BITNSLOTS(256)];
+        struct {
+            int low, high;
+            struct state *partner;
+        } repeat;
     };
     struct state *o1, *o2;
+    int rule;
+    int id;
+};
+
+/* The form the engines run: the states of an NFA flattened into an array of
+ * instructions, with successors as indices (-1 for none) and the entry at 0.
+ * Once optimised, a tree of splits is a STATE_BRANCH, whose n targets,
+ * everything the tree leads to other than splits and branches, are held
+ * from index first of an array alongside. */
+struct inst {
+    enum state_type type;
+    int rule;
+    int x, y;
+    union {
+        unsigned char atom[BITNSLOTS(256)];
+        struct {
+            int low, high;
+            int partner;
+        } repeat;
+        struct {
+            int n;
+            int first;
+        } branch;
+    };
 };
 
 struct ptrlist {
@@ -28,27 +66,27 @@ struct ptrlist {
     struct ptrlist *next;
 };
 
+/* first is the fragment's first token, so that it can be built again. */
 struct frag {
+    struct regex_token *first;
     struct state *start;
     struct ptrlist *out;
     struct frag *prev;
 };
 
-static struct state matchstate = { STATE_MATCH };
+/* Everything token2nfa builds comes from an arena that the caller frees once
+ * the NFA has been flattened. */
 
-static struct ptrlist *ptrlist_alloc(struct state **s) {
-    struct ptrlist *l = malloc(sizeof(*l));
+static struct ptrlist *ptrlist_alloc(struct arena *arena, struct state **s) {
+    struct ptrlist *l = arena_alloc(arena, sizeof(*l));
     l->s = s;
     l->next = NULL;
     return l;
 }
 
 static void ptrlist_patch(struct ptrlist *l, struct state *s) {
-    struct ptrlist *next;
-    for (struct ptrlist *i = l; i; i = next) {
-        next = i->next;
-        *i->s = s;
-        free(i);
+    for (; l; l = l->next) {
+        *l->s = s;
     }
 }
 
@@ -62,127 +100,726 @@ static struct ptrlist *ptrlist_concat(struct ptrlist *l1, struct ptrlist *l2) {
     return oldl1;
 }
 
-static struct frag *frag(struct state *start, struct ptrlist *out, struct frag *prev) {
-    struct frag *frag = malloc(sizeof(*frag));
+static void frag_push(struct arena *arena, struct frag **stackp, struct regex_token *first, struct state *start, struct ptrlist *out) {
+    struct frag *frag = arena_alloc(arena, sizeof(*frag));
+    frag->first = first;
     frag->start = start;
     frag->out = out;
-    frag->prev = prev;
-    return frag;
-}
-
-static void frag_push(struct frag **stackp, struct state *start, struct ptrlist *out) {
-    *stackp = frag(start, out, *stackp);
+    frag->prev = *stackp;
+    *stackp = frag;
 }
 
 static struct frag frag_pop(struct frag **stackp) {
     struct frag frag = **stackp;
-    free(*stackp);
     *stackp = frag.prev;
     frag.prev = NULL;
     return frag;
 }
 
-
-static struct state *state(enum state_type type, struct state *o1, struct state *o2) {
-    struct state *s = malloc(sizeof(*s));
+static struct state *state(struct arena *arena, enum state_type type, struct state *o1, struct state *o2, int rule) {
+    struct state *s = arena_alloc(arena, sizeof(*s));
     s->type = type;
     s->o1 = o1;
     s->o2 = o2;
+    s->rule = rule;
+    s->id = 0;
     return s;
 }
 
-static void state_mark_recursive(struct state *s) {
-    if (!s || s == &matchstate) {
-        return;
+/* A stack of states being numbered, a frame per state. */
+struct state_frame {
+    struct state *s;
+    struct state_frame *prev;
+};
+
+static int state_number(struct state *entry, struct arena *scratch) {
+    /* Give every state reachable from entry an id from 1 on, in the order a
+     * depth-first walk taking o1 before o2 meets them, and return how many
+     * there are.  The walk keeps its stack in scratch rather than recursing,
+     * as patterns can be long; popped frames are reused. */
+
+    struct state_frame *top = NULL,
+                       *spare = NULL;
+    int n = 0;
+
+    struct state *push[2] = {entry, NULL};
+    while (1) {
+        /* o2 goes on first so that o1 is walked first. */
+        for (int k = 1; k >= 0; --k) {
+            if (!push[k] || push[k]->id) {
+                continue;
+            }
+
+            struct state_frame *frame = spare;
+            if (frame) {
+                spare = frame->prev;
+            } else {
+                frame = arena_alloc(scratch, sizeof(*frame));
+            }
+            frame->s = push[k];
+            frame->prev = top;
+            top = frame;
+        }
+
+        struct state *s = NULL;
+        while (top && !s) {
+            struct state_frame *frame = top;
+            top = frame->prev;
+            frame->prev = spare;
+            spare = frame;
+            if (!frame->s->id) {
+                s = frame->s;
+            }
+        }
+        if (!s) {
+            return n;
+        }
+
+        s->id = ++n;
+        push[0] = s->o1;
+        push[1] = s->o2;
+    }
+}
+
+static struct inst *nfa_flatten(struct state *entry, int *ninsts, struct arena *arena, struct arena *scratch) {
+    /* Lay out the NFA at entry as an array of instructions allocated from
+     * arena.  Working space comes from scratch. */
+
+    int n = state_number(entry, scratch);
+    struct inst *insts = arena_alloc(arena, sizeof(*insts) * n);
+    memset(insts, 0, sizeof(*insts) * n);
+
+    for (int i = 0; i < n; ++i) {
+        insts[i].type = STATE_MARK;
+    }
+
+    /* A state is pushed at most once per edge leading to it. */
+    struct state **stack = arena_alloc(scratch, sizeof(*stack) * (2 * n + 1));
+    int top = 0;
+    stack[top++] = entry;
+
+    while (top) {
+        struct state *s = stack[--top];
+        struct inst *inst = &insts[s->id - 1];
+        if (inst->type != STATE_MARK) {
+            continue;
+        }
+
+        inst->type = s->type;
+        inst->rule = s->rule;
+        inst->x = s->o1 ? s->o1->id - 1 : -1;
+        inst->y = s->o2 ? s->o2->id - 1 : -1;
+        if (s->type == STATE_ATOM) {
+            memcpy(inst->atom, s->atom, BITNSLOTS(256));
+        } else if (s->type == STATE_REPEAT || s->type == STATE_COUNT) {
+            inst->repeat.low = s->repeat.low;
+            inst->repeat.high = s->repeat.high;
+            inst->repeat.partner = s->repeat.partner->id - 1;
+        }
+
+        if (s->o1) {
+            stack[top++] = s->o1;
+        }
+        if (s->o2) {
+            stack[top++] = s->o2;
+        }
+    }
+
+    *ninsts = n;
+    return insts;
+}
+
+static int int_cmp(void const *a, void const *b) {
+    int ia = *(int const *)a,
+        ib = *(int const *)b;
+    return ia < ib ? -1 : ia > ib;
+}
+
+/* The most targets a branch may have.  A bigger tree of splits is left as it
+ * is: closures can grow with the square of the pattern, as in a?a?a?... */
+#define NFA_BRANCH_MAX 256
+
+static int nfa_branch(struct inst const *insts, int s, int *seen, int *stack, int *targets) {
+    /* Store the instructions other than splits that split s leads to by
+     * epsilon moves in targets, sorted, and return how many there are, or
+     * -1 if that's more than NFA_BRANCH_MAX.  seen must not yet hold s + 1. */
+
+    int n = 0,
+        top = 0,
+        splits = 0;
+
+    stack[top++] = s;
+    seen[s] = s + 1;
+
+    while (top) {
+        struct inst const *inst = &insts[stack[--top]];
+        int next[2] = {inst->x, inst->y};
+
+        for (int k = 0; k < 2; ++k) {
+            int i = next[k];
+            if (i < 0 || seen[i] == s + 1) {
+                continue;
+            }
+            seen[i] = s + 1;
+
+            if (insts[i].type == STATE_SPLIT) {
+                if (++splits > 4 * NFA_BRANCH_MAX) {
+                    return -1;
+                }
+                stack[top++] = i;
+            } else {
+                if (n == NFA_BRANCH_MAX) {
+                    return -1;
+                }
+                targets[n++] = i;
+            }
+        }
+    }
+
+    qsort(targets, n, sizeof(*targets), int_cmp);
+    return n;
+}
+
+/* Merging works on a graph of the instructions and the branches that replace
+ * their splits.  Each merged node points at the one it was merged into. */
+struct nfa_merge {
+    struct inst *g;
+    int *pool;
+    int *rep;
+    int *hash, *chain, *buckets, nbuckets;
+    int *preds, *pnext, *phead, *ptail;
+    int *work, *queued, top;
+};
+
+static int merge_find(struct nfa_merge *m, int v) {
+    while (m->rep[v] != v) {
+        v = m->rep[v] = m->rep[m->rep[v]];
     }
+    return v;
+}
 
-    s->type = STATE_MARK;
+static unsigned long merge_hash(struct nfa_merge *m, int v) {
+    struct inst const *inst = &m->g[v];
+    unsigned long h = 2166136261u ^ inst->type;
 
-    if (s->o1 && s->o1->type == STATE_MARK) {
-        s->o1 = NULL;
+    if (inst->type == STATE_ATOM) {
+        h = (h ^ (unsigned long)inst->rule) * 16777619u;
+        h = (h ^ (unsigned long)merge_find(m, inst->x)) * 16777619u;
+        for (int k = 0; k < BITNSLOTS(256); ++k) {
+            h = (h ^ inst->atom[k]) * 16777619u;
+        }
+    } else {
+        for (int k = 0; k < inst->branch.n; ++k) {
+            h = (h ^ (unsigned long)m->pool[inst->branch.first + k]) * 16777619u;
+        }
     }
 
-    state_mark_recursive(s->o1);
+    return h & (m->nbuckets - 1);
+}
+
+static void merge_normalise(struct nfa_merge *m, int v) {
+    /* Bring branch v's targets up to date with the merges so far. */
+
+    struct inst *inst = &m->g[v];
+    int *targets = m->pool + inst->branch.first,
+        n = 0;
 
-    if (s->o2 && s->o2->type == STATE_MARK) {
-        s->o2 = NULL;
+    for (int k = 0; k < inst->branch.n; ++k) {
+        targets[k] = merge_find(m, targets[k]);
     }
+    qsort(targets, inst->branch.n, sizeof(*targets), int_cmp);
 
-    state_mark_recursive(s->o2);
+    for (int k = 0; k < inst->branch.n; ++k) {
+        if (!n || targets[k] != targets[n - 1]) {
+            targets[n++] = targets[k];
+        }
+    }
+    inst->branch.n = n;
+}
+
+static int merge_equal(struct nfa_merge *m, int u, int v) {
+    struct inst *a = &m->g[u],
+                *b = &m->g[v];
+
+    if (a->type != b->type) {
+        return 0;
+    }
+
+    if (a->type == STATE_ATOM) {
+        return a->rule == b->rule && merge_find(m, a->x) == merge_find(m, b->x) &&
+            memcmp(a->atom, b->atom, BITNSLOTS(256)) == 0;
+    }
+
+    merge_normalise(m, u);
+    return a->branch.n == b->branch.n &&
+        memcmp(m->pool + a->branch.first, m->pool + b->branch.first, sizeof(int) * a->branch.n) == 0;
 }
 
-static void state_free_recursive(struct state *s) {
-    if (!s || s == &matchstate) {
+static void merge_unhash(struct nfa_merge *m, int v) {
+    if (m->hash[v] < 0) {
         return;
     }
 
-    state_free_recursive(s->o1);
-    state_free_recursive(s->o2);
-    free(s);
+    int *p = &m->buckets[m->hash[v]];
+    while (*p != v) {
+        p = &m->chain[*p];
+    }
+    *p = m->chain[v];
+    m->hash[v] = -1;
 }
 
-static void state_free(struct state *s) {
-    state_mark_recursive(s);
-    state_free_recursive(s);
+static void merge_into(struct nfa_merge *m, int v, int u) {
+    /* Merge v into u, and requeue everything that led to v. */
+
+    m->rep[v] = u;
+
+    for (int e = m->phead[v]; e >= 0; e = m->pnext[e]) {
+        int p = m->preds[e];
+        if (!m->queued[p]) {
+            m->queued[p] = 1;
+            m->work[m->top++] = p;
+        }
+    }
+
+    if (m->phead[v] >= 0) {
+        if (m->phead[u] >= 0) {
+            m->pnext[m->ptail[u]] = m->phead[v];
+        } else {
+            m->phead[u] = m->phead[v];
+        }
+        m->ptail[u] = m->ptail[v];
+    }
 }
 
-static struct state *token2nfa(struct regex_token *token) {
-    if (!token) {
-        return NULL;
+static void merge_run(struct nfa_merge *m) {
+    /* Merge atoms alike in bytes, rule and successor, and branches alike in
+     * targets, until nothing changes.  A merge can only make the nodes that
+     * lead to the merged one alike, so only those are looked at again. */
+
+    while (m->top) {
+        int v = m->work[--m->top];
+        m->queued[v] = 0;
+
+        struct inst *inst = &m->g[v];
+        if (merge_find(m, v) != v || (inst->type != STATE_ATOM && inst->type != STATE_BRANCH)) {
+            continue;
+        }
+
+        merge_unhash(m, v);
+
+        if (inst->type == STATE_BRANCH) {
+            merge_normalise(m, v);
+            if (inst->branch.n == 1) {
+                merge_into(m, v, m->pool[inst->branch.first]);
+                continue;
+            }
+        }
+
+        int h = merge_hash(m, v),
+            u = m->buckets[h];
+        while (u >= 0 && !merge_equal(m, u, v)) {
+            u = m->chain[u];
+        }
+
+        if (u >= 0) {
+            merge_into(m, v, u);
+        } else {
+            m->hash[v] = h;
+            m->chain[v] = m->buckets[h];
+            m->buckets[h] = v;
+        }
     }
+}
+
+static int merge_edges(struct nfa_merge const *m, struct inst const *inst, int *edges) {
+    int n = 0;
+
+    if (inst->type == STATE_BRANCH) {
+        for (int k = 0; k < inst->branch.n; ++k) {
+            edges[n++] = m->pool[inst->branch.first + k];
+        }
+    } else {
+        if (inst->x >= 0) {
+            edges[n++] = inst->x;
+        }
+        if (inst->y >= 0) {
+            edges[n++] = inst->y;
+        }
+    }
+
+    return n;
+}
+
+static struct inst *nfa_optimise(struct inst const *insts, int n, int *ninsts, int **targets_out, int *ntargets, struct arena *arena, struct arena *scratch) {
+    /* Rebuild the flattened NFA insts without chains of epsilon moves, in
+     * arena: every tree of splits becomes a branch straight to the states
+     * it leads to, so that the engines find a state's closure in one step,
+     * and alike atoms and branches are merged.  The branches' targets go in
+     * *targets_out.  Working space comes from scratch. */
+
+    /* Node i is instruction i, or the branch for split i - n. */
+    int size = 2 * n;
+    struct nfa_merge m;
+    m.g = arena_alloc(scratch, sizeof(*m.g) * size);
+    memset(m.g, 0, sizeof(*m.g) * size);
+    m.rep = arena_alloc(scratch, sizeof(*m.rep) * size);
+
+    int *ref = arena_alloc(scratch, sizeof(*ref) * n),
+        *seen = arena_alloc(scratch, sizeof(*seen) * n),
+        *stack = arena_alloc(scratch, sizeof(*stack) * (size + 1)),
+        *targets = arena_alloc(scratch, sizeof(*targets) * NFA_BRANCH_MAX);
+    memset(seen, 0, sizeof(*seen) * n);
+
+    int npool = 0,
+        poolsize = 64;
+    m.pool = arena_alloc(scratch, sizeof(*m.pool) * poolsize);
+
+    /* Where an edge to each instruction should go instead. */
+    for (int i = 0; i < n; ++i) {
+        ref[i] = i;
+        m.g[i] = insts[i];
+
+        if (insts[i].type != STATE_SPLIT) {
+            continue;
+        }
+
+        int k = nfa_branch(insts, i, seen, stack, targets);
+        if (k == 0) {
+            ref[i] = -1;
+        } else if (k == 1) {
+            ref[i] = targets[0];
+        } else if (k > 1) {
+            struct inst *branch = &m.g[n + i];
+            branch->type = STATE_BRANCH;
+            branch->rule = insts[i].rule;
+            branch->x = branch->y = -1;
+            branch->branch.n = k;
+            branch->branch.first = npool;
+
+            if (npool + k > poolsize) {
+                int *pool = arena_alloc(scratch, sizeof(*pool) * (poolsize = 2 * (npool + k)));
+                memcpy(pool, m.pool, sizeof(*pool) * npool);
+                m.pool = pool;
+            }
+            memcpy(m.pool + npool, targets, sizeof(*targets) * k);
+            npool += k;
+
+            ref[i] = n + i;
+        }
+    }
+
+    for (int i = 0; i < n; ++i) {
+        if (m.g[i].x >= 0) {
+            m.g[i].x = ref[m.g[i].x];
+        }
+        if (m.g[i].y >= 0) {
+            m.g[i].y = ref[m.g[i].y];
+        }
+    }
+
+    /* Find the nodes still in use, numbering them in the order found, and
+     * the edges into each. */
+    int *id = arena_alloc(scratch, sizeof(*id) * size),
+        *order = arena_alloc(scratch, sizeof(*order) * size),
+        nnodes = 0,
+        nedges = 0,
+        edges[NFA_BRANCH_MAX];
+    for (int v = 0; v < size; ++v) {
+        id[v] = -1;
+    }
+
+    int root = ref[0] >= 0 ? ref[0] : 0,
+        top = 0;
+    id[root] = nnodes;
+    order[nnodes++] = root;
+    stack[top++] = root;
+
+    while (top) {
+        int v = stack[--top],
+            k = merge_edges(&m, &m.g[v], edges);
+
+        nedges += k;
+        for (int e = k - 1; e >= 0; --e) {
+            if (id[edges[e]] < 0) {
+                id[edges[e]] = nnodes;
+                order[nnodes++] = edges[e];
+                stack[top++] = edges[e];
+            }
+        }
+    }
+
+    m.nbuckets = 1;
+    while (m.nbuckets < size) {
+        m.nbuckets <<= 1;
+    }
+    m.buckets = arena_alloc(scratch, sizeof(*m.buckets) * m.nbuckets);
+    m.hash = arena_alloc(scratch, sizeof(*m.hash) * size);
+    m.chain = arena_alloc(scratch, sizeof(*m.chain) * size);
+    m.preds = arena_alloc(scratch, sizeof(*m.preds) * (nedges + 1));
+    m.pnext = arena_alloc(scratch, sizeof(*m.pnext) * (nedges + 1));
+    m.phead = arena_alloc(scratch, sizeof(*m.phead) * size);
+    m.ptail = arena_alloc(scratch, sizeof(*m.ptail) * size);
+    m.work = arena_alloc(scratch, sizeof(*m.work) * size);
+    m.queued = arena_alloc(scratch, sizeof(*m.queued) * size);
+
+    for (int b = 0; b < m.nbuckets; ++b) {
+        m.buckets[b] = -1;
+    }
+    for (int v = 0; v < size; ++v) {
+        m.rep[v] = v;
+        m.hash[v] = m.phead[v] = -1;
+        m.queued[v] = 0;
+    }
+
+    nedges = 0;
+    for (int j = 0; j < nnodes; ++j) {
+        int v = order[j],
+            k = merge_edges(&m, &m.g[v], edges);
+
+        for (int e = 0; e < k; ++e) {
+            int w = edges[e];
+            m.preds[nedges] = v;
+            m.pnext[nedges] = -1;
+            if (m.phead[w] >= 0) {
+                m.pnext[m.ptail[w]] = nedges;
+            } else {
+                m.phead[w] = nedges;
+            }
+            m.ptail[w] = nedges++;
+        }
+    }
+
+    m.top = 0;
+    for (int j = nnodes - 1; j >= 0; --j) {
+        m.work[m.top++] = order[j];
+        m.queued[order[j]] = 1;
+    }
+
+    merge_run(&m);
+
+    /* Lay out what's left, the entry first. */
+    for (int v = 0; v < size; ++v) {
+        id[v] = -1;
+    }
+
+    root = merge_find(&m, root);
+    nnodes = 0;
+    id[root] = nnodes;
+    order[nnodes++] = root;
+    top = 0;
+    stack[top++] = root;
+
+    while (top) {
+        int v = stack[--top],
+            k = merge_edges(&m, &m.g[v], edges);
+
+        for (int e = k - 1; e >= 0; --e) {
+            int w = merge_find(&m, edges[e]);
+            if (id[w] < 0) {
+                id[w] = nnodes;
+                order[nnodes++] = w;
+                stack[top++] = w;
+            }
+        }
+    }
+
+    struct inst *out = arena_alloc(arena, sizeof(*out) * nnodes);
+
+    *ntargets = 0;
+    for (int j = 0; j < nnodes; ++j) {
+        if (m.g[order[j]].type == STATE_BRANCH) {
+            *ntargets += m.g[order[j]].branch.n;
+        }
+    }
+    int *pool = *targets_out = arena_alloc(arena, sizeof(*pool) * (*ntargets ? *ntargets : 1));
+    npool = 0;
+
+    for (int j = 0; j < nnodes; ++j) {
+        struct inst *inst = &out[j];
+        *inst = m.g[order[j]];
+
+        if (inst->x >= 0) {
+            inst->x = id[merge_find(&m, inst->x)];
+        }
+        if (inst->y >= 0) {
+            inst->y = id[merge_find(&m, inst->y)];
+        }
+
+        if (inst->type == STATE_REPEAT || inst->type == STATE_COUNT) {
+            inst->repeat.partner = id[inst->repeat.partner];
+        } else if (inst->type == STATE_BRANCH) {
+            for (int k = 0; k < inst->branch.n; ++k) {
+                pool[npool + k] = id[merge_find(&m, m.pool[inst->branch.first + k])];
+            }
+            inst->branch.first = npool;
+            npool += inst->branch.n;
+        }
+    }
+
+    *ninsts = nnodes;
+    return out;
+}
+
+static void frag_concat(struct frag *e1, struct frag const *e2) {
+    ptrlist_patch(e1->out, e2->start);
+    e1->out = e2->out;
+}
+
+static void frag_zero_many(struct arena *arena, struct frag *e, int rule) {
+    struct state *s = state(arena, STATE_SPLIT, e->start, NULL, rule);
+    ptrlist_patch(e->out, s);
+    e->start = s;
+    e->out = ptrlist_alloc(arena, &s->o2);
+}
+
+static void frag_one_many(struct arena *arena, struct frag *e, int rule) {
+    struct state *s = state(arena, STATE_SPLIT, e->start, NULL, rule);
+    ptrlist_patch(e->out, s);
+    e->out = ptrlist_alloc(arena, &s->o2);
+}
+
+static void frag_zero_one(struct arena *arena, struct frag *e, int rule) {
+    struct state *s = state(arena, STATE_SPLIT, e->start, NULL, rule);
+    e->start = s;
+    e->out = ptrlist_concat(e->out, ptrlist_alloc(arena, &s->o2));
+}
+
+static int token2frag(struct regex_token *token, struct regex_token *stop, int rule, struct arena *arena, struct frag *frag);
+
+static int frag_repeat(struct arena *arena, struct frag *e, struct regex_token *repeat, int rule) {
+    /* Repeat e, whose tokens run up to repeat, as repeat says. */
+
+    int low = repeat->repeat.low,
+        high = repeat->repeat.high;
+
+    int counted = 0;
+    for (struct regex_token *token = e->first; token != repeat; token = token->next) {
+        counted |= token->type == TYPE_REPEAT;
+    }
+
+    if (!counted) {
+        struct state *entry = state(arena, STATE_REPEAT, e->start, NULL, rule),
+                     *count = state(arena, STATE_COUNT, e->start, NULL, rule);
+        entry->repeat.low = count->repeat.low = low;
+        entry->repeat.high = count->repeat.high = high;
+        entry->repeat.partner = count;
+        count->repeat.partner = entry;
+
+        ptrlist_patch(e->out, count);
+        e->start = entry;
+        e->out = ptrlist_concat(ptrlist_alloc(arena, &entry->o2), ptrlist_alloc(arena, &count->o2));
+        return 1;
+    }
+
+    /* Counts can't nest, so lay out copies of e instead. */
+
+    if (high == 0) {
+        struct state *s = state(arena, STATE_SPLIT, NULL, NULL, rule);
+        e->start = s;
+        e->out = ptrlist_alloc(arena, &s->o1);
+        return 1;
+    }
+
+    int copies = high == -1 ? (low > 1 ? low : 1) : high;
+    struct frag result = *e;
+
+    for (int i = 0; i < copies; ++i) {
+        struct frag copy = *e;
+        if (i > 0 && !token2frag(e->first, repeat, rule, arena, &copy)) {
+            return 0;
+        }
+
+        if (high == -1 && i == copies - 1) {
+            if (low == 0) {
+                frag_zero_many(arena, &copy, rule);
+            } else {
+                frag_one_many(arena, &copy, rule);
+            }
+        } else if (i >= low) {
+            frag_zero_one(arena, &copy, rule);
+        }
+
+        if (i == 0) {
+            result = copy;
+        } else {
+            frag_concat(&result, &copy);
+        }
+    }
+
+    e->start = result.start;
+    e->out = result.out;
+    return 1;
+}
+
+static int token2frag(struct regex_token *token, struct regex_token *stop, int rule, struct arena *arena, struct frag *frag) {
+    /* Build the fragment for the tokens from token up to stop, which must
+     * make up a single expression. */
 
     struct frag *stack = NULL,
                 e1, e2;
     struct state *s;
 
-    for (; token; token = token->next) {
+    for (; token != stop; token = token->next) {
         switch (token->type) {
         case TYPE_ATOM:
-            s = state(STATE_ATOM, NULL, NULL);
+            s = state(arena, STATE_ATOM, NULL, NULL, rule);
             memcpy(s->atom, token->atom, BITNSLOTS(256));
-            frag_push(&stack, s, ptrlist_alloc(&s->o1));
+            frag_push(arena, &stack, token, s, ptrlist_alloc(arena, &s->o1));
             break;
         case TYPE_CONCAT:
             e2 = frag_pop(&stack);
             e1 = frag_pop(&stack);
-            ptrlist_patch(e1.out, e2.start);
-            frag_push(&stack, e1.start, e2.out);
+            frag_concat(&e1, &e2);
+            frag_push(arena, &stack, e1.first, e1.start, e1.out);
             break;
         case TYPE_ALTERNATIVE:
             e2 = frag_pop(&stack);
             e1 = frag_pop(&stack);
-            s = state(STATE_SPLIT, e1.start, e2.start);
-            frag_push(&stack, s, ptrlist_concat(e1.out, e2.out));
+            s = state(arena, STATE_SPLIT, e1.start, e2.start, rule);
+            frag_push(arena, &stack, e1.first, s, ptrlist_concat(e1.out, e2.out));
             break;
         case TYPE_ZERO_MANY:
             e1 = frag_pop(&stack);
-            s = state(STATE_SPLIT, e1.start, NULL);
-            ptrlist_patch(e1.out, s);
-            frag_push(&stack, s, ptrlist_alloc(&s->o2));
+            frag_zero_many(arena, &e1, rule);
+            frag_push(arena, &stack, e1.first, e1.start, e1.out);
             break;
         case TYPE_ONE_MANY:
             e1 = frag_pop(&stack);
-            s = state(STATE_SPLIT, e1.start, NULL);
-            ptrlist_patch(e1.out, s);
-            frag_push(&stack, e1.start, ptrlist_alloc(&s->o2));
+            frag_one_many(arena, &e1, rule);
+            frag_push(arena, &stack, e1.first, e1.start, e1.out);
             break;
         case TYPE_ZERO_ONE:
             e1 = frag_pop(&stack);
-            s = state(STATE_SPLIT, e1.start, NULL);
-            frag_push(&stack, s, ptrlist_concat(e1.out, ptrlist_alloc(&s->o2)));
+            frag_zero_one(arena, &e1, rule);
+            frag_push(arena, &stack, e1.first, e1.start, e1.out);
+            break;
+        case TYPE_REPEAT:
+            e1 = frag_pop(&stack);
+            if (!frag_repeat(arena, &e1, token, rule)) {
+                return 0;
+            }
+            frag_push(arena, &stack, e1.first, e1.start, e1.out);
             break;
         }
     }
 
-    e1 = frag_pop(&stack);
-    ptrlist_patch(e1.out, &matchstate);
+    if (!stack || stack->prev) {
+        return 0;
+    }
+
+    *frag = frag_pop(&stack);
+    return 1;
+}
+
+static struct state *token2nfa(struct regex_token *token, struct state *match, struct arena *arena) {
+    struct frag frag;
 
-    if (stack) {
-        state_free(e1.start);
+    if (!token || !token2frag(token, NULL, match->rule, arena, &frag)) {
         return NULL;
     }
 
-    return e1.start;
+    ptrlist_patch(frag.out, match);
+    return frag.start;
 }
 
 #endif
@@ -0,0 +1,105 @@
+#ifndef SONAVARA_SCAN_INCLUDED
+#define SONAVARA_SCAN_INCLUDED
+
+/* Skipping over runs of bytes from a set, for automaton states that loop on
+ * themselves.
+ *
+ * A set is 32 bytes, laid out for nibble lookups: byte b is in the set if
+ * bit (b >> 4) of set[b & 15] is, for b < 128, or bit (b >> 4) - 8 of
+ * set[16 + (b & 15)] otherwise.  That lets the x86 kernels test 16 or 32
+ * bytes at once with two table shuffles.  The kernel is picked by CPU
+ * when the program starts, so that threads never race to pick it. */
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(SONAVARA_NO_SIMD)
+#define SCAN_SIMD
+#include <immintrin.h>
+#endif
+
+static int scan_set_contains(unsigned char const *set, int c) {
+    return set[(c & 15) + (c & 128 ? 16 : 0)] & (1 << ((c >> 4) & 7));
+}
+
+static char const *scan_run_scalar(unsigned char const *set, char const *s, char const *end) {
+    /* Return the first byte from s not in set, or end. */
+
+    while (s < end && scan_set_contains(set, (unsigned char)*s)) {
+        ++s;
+    }
+
+    return s;
+}
+
+#ifdef SCAN_SIMD
+
+__attribute__((target("ssse3")))
+static char const *scan_run_ssse3(unsigned char const *set, char const *s, char const *end) {
+    __m128i lo = _mm_loadu_si128((__m128i const *)set),
+            hi = _mm_loadu_si128((__m128i const *)(set + 16)),
+            bits = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128),
+            nibble = _mm_set1_epi8(0x0f),
+            flip = _mm_set1_epi8(-128);
+
+    for (; end - s >= 16; s += 16) {
+        __m128i v = _mm_loadu_si128((__m128i const *)s);
+
+        /* A shuffle index with its top bit set gives 0, so each table
+         * only answers for its own half of the bytes. */
+        __m128i row = _mm_or_si128(_mm_shuffle_epi8(lo, v),
+                                   _mm_shuffle_epi8(hi, _mm_xor_si128(v, flip)));
+        __m128i bit = _mm_shuffle_epi8(bits, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+
+        int in = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(row, bit), bit));
+        if (in != 0xffff) {
+            return s + __builtin_ctz(~in);
+        }
+    }
+
+    return scan_run_scalar(set, s, end);
+}
+
+__attribute__((target("avx2")))
+static char const *scan_run_avx2(unsigned char const *set, char const *s, char const *end) {
+    __m256i lo = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const *)set)),
+            hi = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i const *)(set + 16))),
+            bits = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128,
+                                    1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128),
+            nibble = _mm256_set1_epi8(0x0f),
+            flip = _mm256_set1_epi8(-128);
+
+    for (; end - s >= 32; s += 32) {
+        __m256i v = _mm256_loadu_si256((__m256i const *)s);
+
+        __m256i row = _mm256_or_si256(_mm256_shuffle_epi8(lo, v),
+                                      _mm256_shuffle_epi8(hi, _mm256_xor_si256(v, flip)));
+        __m256i bit = _mm256_shuffle_epi8(bits, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+
+        unsigned in = _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(row, bit), bit));
+        if (in != 0xffffffffu) {
+            return s + __builtin_ctz(~in);
+        }
+    }
+
+    return scan_run_ssse3(set, s, end);
+}
+
+#endif
+
+static char const *(*scan_run)(unsigned char const *set, char const *s, char const *end) = scan_run_scalar;
+
+#ifdef SCAN_SIMD
+
+__attribute__((constructor))
+static void scan_run_init(void) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        scan_run = scan_run_avx2;
+    } else if (__builtin_cpu_supports("ssse3")) {
+        scan_run = scan_run_ssse3;
+    }
+}
+
+#endif
+
+#endif
+
+/* vim: set sw=4 et: */
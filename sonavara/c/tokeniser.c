@@ -6,6 +6,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifndef SONAVARA_NO_SELF_CHAIN
+#include "arena.c"
+#include "unicode.c"
+#endif
+
 #define BITMASK(b) (1 << ((b) % CHAR_BIT))
 #define BITSLOT(b) ((b) / CHAR_BIT)
 #define BITSET(a, b) ((a)[BITSLOT(b)] |= BITMASK(b))
@@ -20,51 +25,355 @@ enum regex_token_type {
     TYPE_ZERO_MANY,
     TYPE_ONE_MANY,
     TYPE_ZERO_ONE,
+    TYPE_REPEAT,
 };
 
+/* A TYPE_REPEAT token repeats its operand at least low and at most high
+ * times, or without limit if high is -1. */
 struct regex_token {
     enum regex_token_type type;
-    unsigned char atom[BITNSLOTS(256)];
+    union {
+        unsigned char atom[BITNSLOTS(256)];
+        struct {
+            int low, high;
+        } repeat;
+    };
     struct regex_token *next;
 };
 
+/* The largest bound a repetition may have. */
+#define REPEAT_MAX 65535
+
+#define CODEPOINT_MAX 0x10ffff
+
+/* A set of code points as n inclusive ranges, sorted and disjoint once
+ * normalised.  ranges has room for cap of them. */
+struct codepoints {
+    int n;
+    int cap;
+    int (*ranges)[2];
+};
+
 struct paren {
     int nalt;
     int natom;
     int opts;
-    char const *last;
     struct paren *prev;
 };
 
-static void token_append(struct regex_token ***writep, enum regex_token_type type) {
-    **writep = malloc(sizeof(***writep));
-    (**writep)->type = type;
-    (**writep)->next = NULL;
-    *writep = &((**writep)->next);
+static struct regex_token *token_append(struct arena *arena, struct regex_token ***writep, enum regex_token_type type) {
+    struct regex_token *token = **writep = arena_alloc(arena, sizeof(***writep));
+    token->type = type;
+    token->next = NULL;
+    *writep = &token->next;
+    return token;
 }
 
-static void token_append_atom(struct regex_token ***writep, unsigned char *atom) {
-    **writep = malloc(sizeof(***writep));
+static void token_append_atom(struct arena *arena, struct regex_token ***writep, unsigned char *atom) {
+    **writep = arena_alloc(arena, sizeof(***writep));
     (**writep)->type = TYPE_ATOM;
     memcpy((**writep)->atom, atom, BITNSLOTS(256));
     (**writep)->next = NULL;
     *writep = &((**writep)->next);
 }
 
-static void token_free(struct regex_token *token) {
-    while (token) {
-        struct regex_token *next = token->next;
-        free(token);
-        token = next;
+static void codepoints_add(struct arena *arena, struct codepoints *set, int lo, int hi) {
+    if (set->n == set->cap) {
+        set->cap = set->cap ? set->cap * 2 : 16;
+        int (*ranges)[2] = arena_alloc(arena, sizeof(*ranges) * set->cap);
+        if (set->n) {
+            memcpy(ranges, set->ranges, sizeof(*ranges) * set->n);
+        }
+        set->ranges = ranges;
+    }
+
+    set->ranges[set->n][0] = lo;
+    set->ranges[set->n][1] = hi;
+    ++set->n;
+}
+
+static int codepoints_compare(void const *a, void const *b) {
+    int const *x = a, *y = b;
+    return x[0] < y[0] ? -1 : x[0] > y[0];
+}
+
+static void codepoints_normalise(struct codepoints *set) {
+    if (!set->n) {
+        return;
+    }
+
+    qsort(set->ranges, set->n, sizeof(*set->ranges), codepoints_compare);
+
+    int n = 0;
+    for (int i = 1; i < set->n; ++i) {
+        if (set->ranges[i][0] <= set->ranges[n][1] + 1) {
+            if (set->ranges[i][1] > set->ranges[n][1]) {
+                set->ranges[n][1] = set->ranges[i][1];
+            }
+        } else {
+            ++n;
+            set->ranges[n][0] = set->ranges[i][0];
+            set->ranges[n][1] = set->ranges[i][1];
+        }
+    }
+    set->n = n + 1;
+}
+
+static void codepoints_negate(struct arena *arena, struct codepoints *set) {
+    /* set must be normalised. */
+
+    struct codepoints negated = {0};
+    int next = 0;
+
+    for (int i = 0; i < set->n; ++i) {
+        if (set->ranges[i][0] > next) {
+            codepoints_add(arena, &negated, next, set->ranges[i][0] - 1);
+        }
+        next = set->ranges[i][1] + 1;
+    }
+    if (next <= CODEPOINT_MAX) {
+        codepoints_add(arena, &negated, next, CODEPOINT_MAX);
+    }
+
+    *set = negated;
+}
+
+static int utf8_decode(char const **pattern) {
+    /* If *pattern starts a well-formed UTF-8 sequence of two bytes or more,
+     * return its code point, leaving *pattern on its last byte.  Otherwise
+     * return -1. */
+
+    static int const least[] = {0, 0, 0x80, 0x800, 0x10000};
+    unsigned char const *s = (unsigned char const *)*pattern;
+    int len, cp;
+
+    if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+        len = 2;
+        cp = s[0] & 0x1f;
+    } else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+        len = 3;
+        cp = s[0] & 0x0f;
+    } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+        len = 4;
+        cp = s[0] & 0x07;
+    } else {
+        return -1;
+    }
+
+    for (int i = 1; i < len; ++i) {
+        if ((s[i] & 0xc0) != 0x80) {
+            return -1;
+        }
+        cp = (cp << 6) | (s[i] & 0x3f);
+    }
+
+    if (cp < least[len] || cp > CODEPOINT_MAX || (cp >= 0xd800 && cp <= 0xdfff)) {
+        return -1;
+    }
+
+    *pattern += len - 1;
+    return cp;
+}
+
+static int utf8_append(struct arena *arena, struct regex_token ***writep, int (*ranges)[2], int n, int shift, int marker) {
+    /* Append an expression matching the UTF-8 encodings of the n ranges, or
+     * return 0 if there are none.  A code point x starts with the byte
+     * marker + (x >> shift), followed by shift / 6 continuation bytes for the
+     * rest of it.  Leading bytes followed by the same continuations share
+     * an atom, and the continuations only appear once. */
+
+    if (!n) {
+        return 0;
+    }
+
+    int first = ranges[0][0] >> shift,
+        nbytes = (ranges[n - 1][1] >> shift) - first + 1;
+
+    /* What follows each leading byte, as ranges of what's left of the code
+     * point once it's taken off. */
+    int (*rest)[2] = arena_alloc(arena, sizeof(*rest) * (n + nbytes));
+    int *from = arena_alloc(arena, sizeof(*from) * nbytes),
+        *count = arena_alloc(arena, sizeof(*count) * nbytes),
+        *shared = arena_alloc(arena, sizeof(*shared) * nbytes);
+    int nrest = 0;
+
+    for (int b = 0, i = 0; b < nbytes; ++b) {
+        int lo = (first + b) << shift,
+            hi = lo + (1 << shift) - 1;
+
+        while (i < n && ranges[i][1] < lo) {
+            ++i;
+        }
+
+        from[b] = nrest;
+        for (int j = i; j < n && ranges[j][0] <= hi; ++j) {
+            rest[nrest][0] = (ranges[j][0] > lo ? ranges[j][0] : lo) - lo;
+            rest[nrest][1] = (ranges[j][1] < hi ? ranges[j][1] : hi) - lo;
+            ++nrest;
+        }
+        count[b] = nrest - from[b];
+
+        shared[b] = b;
+        for (int c = 0; c < b; ++c) {
+            if (count[c] && count[c] == count[b] &&
+                    memcmp(rest[from[c]], rest[from[b]], sizeof(*rest) * count[b]) == 0) {
+                shared[b] = shared[c];
+                break;
+            }
+        }
+    }
+
+    int alternatives = 0;
+    for (int b = 0; b < nbytes; ++b) {
+        if (!count[b] || shared[b] != b) {
+            continue;
+        }
+
+        unsigned char atom[BITNSLOTS(256)];
+        memset(atom, 0, BITNSLOTS(256));
+        for (int c = b; c < nbytes; ++c) {
+            if (count[c] && shared[c] == b) {
+                BITSET(atom, marker + first + c);
+            }
+        }
+        token_append_atom(arena, writep, atom);
+
+        if (shift) {
+            utf8_append(arena, writep, rest + from[b], count[b], shift - 6, 0x80);
+            token_append(arena, writep, TYPE_CONCAT);
+        }
+
+        if (alternatives++) {
+            token_append(arena, writep, TYPE_ALTERNATIVE);
+        }
+    }
+
+    return 1;
+}
+
+static void token_append_utf8(struct arena *arena, struct regex_token ***writep, struct codepoints *set) {
+    /* Append an expression matching the UTF-8 encoding of any code point in
+     * set, a byte at a time. */
+
+    static int const lengths[][4] = {
+        /* Lowest and highest code point, shift and marker for utf8_append. */
+        {0, 0x7f, 0, 0},
+        {0x80, 0x7ff, 6, 0xc0},
+        {0x800, 0xffff, 12, 0xe0},
+        {0x10000, CODEPOINT_MAX, 18, 0xf0},
+    };
+
+    codepoints_normalise(set);
+    int (*ranges)[2] = arena_alloc(arena, sizeof(*ranges) * (set->n + 1));
+    int alternatives = 0;
+
+    for (int l = 0; l < 4; ++l) {
+        int n = 0;
+        for (int i = 0; i < set->n; ++i) {
+            int lo = set->ranges[i][0] > lengths[l][0] ? set->ranges[i][0] : lengths[l][0],
+                hi = set->ranges[i][1] < lengths[l][1] ? set->ranges[i][1] : lengths[l][1];
+
+            /* Surrogates have no encoding. */
+            if (lo <= 0xdfff && hi >= 0xd800) {
+                if (lo < 0xd800) {
+                    ranges[n][0] = lo;
+                    ranges[n++][1] = 0xd7ff;
+                }
+                lo = 0xe000;
+            }
+
+            if (lo <= hi) {
+                ranges[n][0] = lo;
+                ranges[n++][1] = hi;
+            }
+        }
+
+        if (utf8_append(arena, writep, ranges, n, lengths[l][2], lengths[l][3]) && alternatives++) {
+            token_append(arena, writep, TYPE_ALTERNATIVE);
+        }
+    }
+
+    if (!alternatives) {
+        unsigned char atom[BITNSLOTS(256)];
+        memset(atom, 0, BITNSLOTS(256));
+        token_append_atom(arena, writep, atom);
     }
 }
 
-static void paren_free(struct paren *paren) {
-    while (paren) {
-        struct paren *prev = paren->prev;
-        free(paren);
-        paren = prev;
+static int process_codepoint(char const **pattern) {
+    /* *pattern is on the u of \u{...}: return the code point, leaving
+     * *pattern on the closing brace, or -1 if it's malformed or a
+     * surrogate. */
+
+    char const *p = *pattern + 1;
+    if (*p != '{') {
+        return -1;
+    }
+
+    int cp = 0, digits = 0;
+    for (++p; isxdigit((unsigned char)*p); ++p) {
+        int c = tolower((unsigned char)*p);
+        cp = (cp * 16) + (isdigit(c) ? c - '0' : c - 'a' + 10);
+        if (++digits > 6) {
+            return -1;
+        }
+    }
+
+    if (*p != '}' || !digits || cp > CODEPOINT_MAX || (cp >= 0xd800 && cp <= 0xdfff)) {
+        return -1;
     }
+
+    *pattern = p;
+    return cp;
+}
+
+static int process_category(struct arena *arena, char const **pattern, struct codepoints *set) {
+    /* *pattern is on the p of \p{Lu} or \pL, or the P of \P{...}: add the
+     * code points of that general category to set, or those of every
+     * category starting with a single letter, or for \P those of none of
+     * them.  Leave *pattern on the name's last byte or closing brace.
+     * Return 0 if there's no such category. */
+
+    int negate = **pattern == 'P';
+    char const *name = *pattern + 1, *last = name;
+    size_t len = 1;
+
+    if (*name == '{') {
+        last = strchr(++name, '}');
+        if (!last) {
+            return 0;
+        }
+        len = last - name;
+    }
+
+    if (len < 1 || len > 2) {
+        return 0;
+    }
+
+    struct codepoints found = {0};
+    for (struct unicode_category const *category = unicode_categories; category->name; ++category) {
+        if (strncmp(category->name, name, len) == 0) {
+            for (int i = 0; i < category->n; ++i) {
+                codepoints_add(arena, &found, unicode_ranges[category->from + i][0], unicode_ranges[category->from + i][1]);
+            }
+        }
+    }
+
+    if (!found.n) {
+        return 0;
+    }
+
+    if (negate) {
+        codepoints_normalise(&found);
+        codepoints_negate(arena, &found);
+    }
+
+    for (int i = 0; i < found.n; ++i) {
+        codepoints_add(arena, set, found.ranges[i][0], found.ranges[i][1]);
+    }
+
+    *pattern = last;
+    return 1;
 }
 
 static int process_escape(char const **pattern) {
@@ -98,7 +407,7 @@ static int process_escape(char const **pattern) {
         case 'r': v = '\r'; break;
         case 't': v = '\t'; break;
         case 'v': v = '\v'; break;
-        default: v = **pattern; break;
+        default: v = (unsigned char)**pattern; break;
         }
     }
 
@@ -132,26 +441,31 @@ enum tokeniser_state {
 
 struct tokeniser {
     enum tokeniser_state state;
+    struct arena *arena;
     struct regex_token **write;
 
     struct paren *paren;
     int natom;
     int nalt;
     int opts;
-    char const *last;
 
-    char const *brace_start;
     int brace_low;
     int brace_high;
 
+    /* cclass_last is the character a - would start a range from, or -1.  A
+     * class that uses \u, \p or a character beyond ASCII matches a code
+     * point as UTF-8, not a byte: cclass_unicode is set, and its members are
+     * the bytes in cclass_atom, taken as code points, and cclass_codepoints. */
     int cclass_negated;
     int cclass_last;
     int cclass_binary;
+    int cclass_unicode;
     unsigned char cclass_atom[BITNSLOTS(256)];
     unsigned char cclass_atom_parent[BITNSLOTS(256)];
+    struct codepoints cclass_codepoints;
 };
 
-static int process(struct tokeniser *sp, char const *pattern, char const *stop);
+static int process(struct tokeniser *sp, char const *pattern);
 static int tokenise_default(struct tokeniser *sp, char const **pattern);
 static int tokenise_paren_opts(struct tokeniser *sp, int v, int disable);
 static int tokenise_escape(struct tokeniser *sp, char const **pattern);
@@ -160,27 +474,27 @@ static int tokenise_brace_post_comma(struct tokeniser *sp, int v);
 static int tokenise_cclass_start(struct tokeniser *sp, char const **pattern);
 static int tokenise_cclass_mid(struct tokeniser *sp, char const **pattern);
 static int tokenise_cclass_range(struct tokeniser *sp, char const **pattern);
+static int tokenise_cclass_escape(struct tokeniser *sp, char const **pattern);
 static int tokenise_cclass_post(struct tokeniser *sp, char const **pattern);
 static void cclass_post_cleanup(struct tokeniser *sp);
 
-static struct regex_token *tokenise(char const *pattern) {
+static struct regex_token *tokenise(char const *pattern, struct arena *arena) {
+    /* Tokens are allocated from arena. */
+
     struct regex_token *r = NULL;
 
     struct tokeniser s;
     memset(&s, 0, sizeof(s));
 
     s.state = DEFAULT;
+    s.arena = arena;
     s.write = &r;
 
-    if (!process(&s, pattern, NULL)) {
-        paren_free(s.paren);
-        token_free(r);
+    if (!process(&s, pattern)) {
         return NULL;
     }
 
     if (s.paren) {
-        paren_free(s.paren);
-        token_free(r);
         return NULL;
     }
 
@@ -189,25 +503,24 @@ static struct regex_token *tokenise(char const *pattern) {
     }
 
     if (s.state != DEFAULT) {
-        token_free(r);
         return NULL;
     }
 
     while (--s.natom > 0) {
-        token_append(&s.write, TYPE_CONCAT);
+        token_append(s.arena, &s.write, TYPE_CONCAT);
     }
 
     for (; s.nalt > 0; --s.nalt) {
-        token_append(&s.write, TYPE_ALTERNATIVE);
+        token_append(s.arena, &s.write, TYPE_ALTERNATIVE);
     }
 
     return r;
 }
 
-static int process(struct tokeniser *sp, char const *pattern, char const *stop) {
-    for (; pattern != stop && *pattern; ++pattern) {
+static int process(struct tokeniser *sp, char const *pattern) {
+    for (; *pattern; ++pattern) {
         int abort = 0,
-            v = *pattern;
+            v = (unsigned char)*pattern;
 
         switch (sp->state) {
         case DEFAULT:
@@ -261,15 +574,7 @@ static int process(struct tokeniser *sp, char const *pattern, char const *stop)
             break;
 
         case CCLASS_ESCAPE:
-            sp->state = CCLASS_MID;
-            v = process_escape(&pattern);
-
-            if (sp->opts & OPT_I) {
-                BITSET(sp->cclass_atom, tolower(v));
-                BITSET(sp->cclass_atom, toupper(v));
-            } else {
-                BITSET(sp->cclass_atom, v);
-            }
+            abort = !tokenise_cclass_escape(sp, &pattern);
             break;
 
         case CCLASS_POST:
@@ -298,29 +603,68 @@ static int process(struct tokeniser *sp, char const *pattern, char const *stop)
     return 1;
 }
 
+static void token_append_codepoints(struct tokeniser *sp, struct codepoints *set) {
+    if (sp->natom > 1) {
+        --sp->natom;
+        token_append(sp->arena, &sp->write, TYPE_CONCAT);
+    }
+
+    token_append_utf8(sp->arena, &sp->write, set);
+    ++sp->natom;
+}
+
+static void token_append_codepoint(struct tokeniser *sp, int cp) {
+    struct codepoints set = {0};
+    codepoints_add(sp->arena, &set, cp, cp);
+    if (sp->opts & OPT_I && cp < 0x80) {
+        codepoints_add(sp->arena, &set, tolower(cp), tolower(cp));
+        codepoints_add(sp->arena, &set, toupper(cp), toupper(cp));
+    }
+
+    token_append_codepoints(sp, &set);
+}
+
+static void cclass_add(struct tokeniser *sp, int lo, int hi) {
+    /* Add lo to hi to the class: bytes to cclass_atom, and code points past
+     * them to cclass_codepoints. */
+
+    for (int i = lo; i <= hi && i < 256; ++i) {
+        if (sp->opts & OPT_I) {
+            BITSET(sp->cclass_atom, (unsigned char)tolower(i));
+            BITSET(sp->cclass_atom, (unsigned char)toupper(i));
+        } else {
+            BITSET(sp->cclass_atom, i);
+        }
+    }
+
+    if (hi >= 256 && lo <= hi) {
+        codepoints_add(sp->arena, &sp->cclass_codepoints, lo > 256 ? lo : 256, hi);
+    }
+}
+
 static int tokenise_default(struct tokeniser *sp, char const **pattern) {
     unsigned char atom[BITNSLOTS(256)];
+    int cp;
 
     switch (**pattern) {
     case '{':
         sp->state = BRACE_PRE_COMMA;
         sp->brace_low = -1;
         sp->brace_high = -1;
-        sp->brace_start = *pattern;
         break;
 
     case '\\':
         sp->state = ESCAPE;
-        sp->last = *pattern;
         break;
 
     case '[':
         sp->state = CCLASS_START;
         sp->cclass_negated = 0;
-        sp->cclass_last = 0;
+        sp->cclass_last = -1;
         sp->cclass_binary = 0;
+        sp->cclass_unicode = 0;
+        sp->cclass_codepoints.n = 0;
         memset(sp->cclass_atom, 0, BITNSLOTS(256));
-        sp->last = *pattern;
         break;
 
     case '(':
@@ -337,21 +681,19 @@ static int tokenise_default(struct tokeniser *sp, char const **pattern) {
 
         if (sp->natom > 1) {
             --sp->natom;
-            token_append(&sp->write, TYPE_CONCAT);
+            token_append(sp->arena, &sp->write, TYPE_CONCAT);
         }
 
-        struct paren *new_paren = malloc(sizeof(*new_paren));
+        struct paren *new_paren = arena_alloc(sp->arena, sizeof(*new_paren));
         new_paren->nalt = sp->nalt;
         new_paren->natom = sp->natom;
         new_paren->opts = sp->opts;
-        new_paren->last = *pattern;
         new_paren->prev = sp->paren;
         sp->paren = new_paren;
 
         sp->nalt = 0;
         sp->natom = 0;
         // sp->opts carries through
-        sp->last = 0;
         break;
 
     case ')':
@@ -360,20 +702,17 @@ static int tokenise_default(struct tokeniser *sp, char const **pattern) {
         }
 
         while (--sp->natom > 0) {
-            token_append(&sp->write, TYPE_CONCAT);
+            token_append(sp->arena, &sp->write, TYPE_CONCAT);
         }
         
         for (; sp->nalt > 0; --sp->nalt) {
-            token_append(&sp->write, TYPE_ALTERNATIVE);
+            token_append(sp->arena, &sp->write, TYPE_ALTERNATIVE);
         }
 
         sp->nalt = sp->paren->nalt;
         sp->natom = sp->paren->natom;
         sp->opts = sp->paren->opts;
-        sp->last = sp->paren->last;
-        struct paren *old_paren = sp->paren->prev;
-        free(sp->paren);
-        sp->paren = old_paren;
+        sp->paren = sp->paren->prev;
 
         ++sp->natom;
         break;
@@ -384,48 +723,43 @@ static int tokenise_default(struct tokeniser *sp, char const **pattern) {
             return 0;
         }
         while (--sp->natom > 0) {
-            token_append(&sp->write, TYPE_CONCAT);
+            token_append(sp->arena, &sp->write, TYPE_CONCAT);
         }
         ++sp->nalt;
-        sp->last = 0;
         break;
 
     case '*':
         if (sp->natom == 0) {
             return 0;
         }
-        token_append(&sp->write, TYPE_ZERO_MANY);
-        sp->last = 0;
+        token_append(sp->arena, &sp->write, TYPE_ZERO_MANY);
         break;
 
     case '+':
         if (sp->natom == 0) {
             return 0;
         }
-        token_append(&sp->write, TYPE_ONE_MANY);
-        sp->last = 0;
+        token_append(sp->arena, &sp->write, TYPE_ONE_MANY);
         break;
 
     case '?':
         if (sp->natom == 0) {
             return 0;
         }
-        token_append(&sp->write, TYPE_ZERO_ONE);
-        sp->last = 0;
+        token_append(sp->arena, &sp->write, TYPE_ZERO_ONE);
         break;
 
     case '.':
         if (sp->natom > 1) {
             --sp->natom;
-            token_append(&sp->write, TYPE_CONCAT);
+            token_append(sp->arena, &sp->write, TYPE_CONCAT);
         }
         memset(atom, 0xff, BITNSLOTS(256));
         if (!(sp->opts & OPT_S)) {
             BITCLEAR(atom, '\n');
         }
-        token_append_atom(&sp->write, atom);
+        token_append_atom(sp->arena, &sp->write, atom);
         ++sp->natom;
-        sp->last = *pattern;
         break;
 
     case ' ':
@@ -439,20 +773,24 @@ static int tokenise_default(struct tokeniser *sp, char const **pattern) {
         /* fallthrough */
 
     default:
+        if ((cp = utf8_decode(pattern)) >= 0) {
+            token_append_codepoint(sp, cp);
+            break;
+        }
+
         if (sp->natom > 1) {
             --sp->natom;
-            token_append(&sp->write, TYPE_CONCAT);
+            token_append(sp->arena, &sp->write, TYPE_CONCAT);
         }
         memset(atom, 0, BITNSLOTS(256));
         if (sp->opts & OPT_I) {
-            BITSET(atom, tolower(**pattern));
-            BITSET(atom, toupper(**pattern));
+            BITSET(atom, tolower((unsigned char)**pattern));
+            BITSET(atom, toupper((unsigned char)**pattern));
         } else {
-            BITSET(atom, **pattern);
+            BITSET(atom, (unsigned char)**pattern);
         }
-        token_append_atom(&sp->write, atom);
+        token_append_atom(sp->arena, &sp->write, atom);
         ++sp->natom;
-        sp->last = *pattern;
         break;
     }
 
@@ -494,9 +832,27 @@ static int tokenise_paren_opts(struct tokeniser *sp, int v, int disable) {
 static int tokenise_escape(struct tokeniser *sp, char const **pattern) {
     sp->state = DEFAULT;
 
+    if (**pattern == 'u') {
+        int cp = process_codepoint(pattern);
+        if (cp < 0) {
+            return 0;
+        }
+        token_append_codepoint(sp, cp);
+        return 1;
+    }
+
+    if (**pattern == 'p' || **pattern == 'P') {
+        struct codepoints set = {0};
+        if (!process_category(sp->arena, pattern, &set)) {
+            return 0;
+        }
+        token_append_codepoints(sp, &set);
+        return 1;
+    }
+
     if (sp->natom > 1) {
         --sp->natom;
-        token_append(&sp->write, TYPE_CONCAT);
+        token_append(sp->arena, &sp->write, TYPE_CONCAT);
     }
 
     unsigned char atom[256];
@@ -511,12 +867,34 @@ static int tokenise_escape(struct tokeniser *sp, char const **pattern) {
         BITSET(atom, v);
     }
 
-    token_append_atom(&sp->write, atom);
+    token_append_atom(sp->arena, &sp->write, atom);
     ++sp->natom;
 
     return 1;
 }
 
+static int tokenise_repeat(struct tokeniser *sp, int low, int high) {
+    /* Repeat the atom just tokenised.  high is -1 for no upper bound. */
+
+    if (sp->natom == 0 || (high != -1 && high < low)) {
+        return 0;
+    }
+
+    if (low == 0 && high == -1) {
+        token_append(sp->arena, &sp->write, TYPE_ZERO_MANY);
+    } else if (low == 1 && high == -1) {
+        token_append(sp->arena, &sp->write, TYPE_ONE_MANY);
+    } else if (low == 0 && high == 1) {
+        token_append(sp->arena, &sp->write, TYPE_ZERO_ONE);
+    } else if (low != 1 || high != 1) {
+        struct regex_token *token = token_append(sp->arena, &sp->write, TYPE_REPEAT);
+        token->repeat.low = low;
+        token->repeat.high = high;
+    }
+
+    return 1;
+}
+
 static int tokenise_brace_pre_comma(struct tokeniser *sp, int v) {
     if (v == ',') {
         sp->state = BRACE_POST_COMMA;
@@ -529,18 +907,7 @@ static int tokenise_brace_pre_comma(struct tokeniser *sp, int v) {
         }
 
         sp->state = DEFAULT;
-
-        char const *last = sp->last,
-             *brace_start = sp->brace_start;
-        int brace_low = sp->brace_low;
-
-        for (int i = 0; i < brace_low - 1; ++i) {
-            if (!process(sp, last, brace_start)) {
-                return 0;
-            }
-        }
-
-        return 1;
+        return tokenise_repeat(sp, sp->brace_low, sp->brace_low);
     }
 
     if (!isdigit(v)) {
@@ -552,77 +919,25 @@ static int tokenise_brace_pre_comma(struct tokeniser *sp, int v) {
     }
 
     sp->brace_low = (sp->brace_low * 10) + (v - '0');
-    return 1;
+    return sp->brace_low <= REPEAT_MAX;
 }
 
 static int tokenise_brace_post_comma(struct tokeniser *sp, int v) {
     if (v == '}') {
         sp->state = DEFAULT;
-
-        char const *last = sp->last,
-             *brace_start = sp->brace_start;
-
-        int brace_low = sp->brace_low < 1 ? 0 : sp->brace_low,
-            brace_high = sp->brace_high;
-
-        // Note that one instance of the to-be-repeated content is already on
-        // the token stream.
-
-        if (brace_low == 0 && brace_high == -1) {
-            if (!process(sp, "*", NULL)) {
-                return 0;
-            }
-        } else if (brace_low == 1 && brace_high == -1) {
-            if (!process(sp, "+", NULL)) {
-                return 0;
-            }
-        } else if (brace_high == -1) {
-            for (int i = 1; i < brace_low; ++i) {
-                if (!process(sp, last, brace_start)) {
-                    return 0;
-                }
-            }
-            if (!process(sp, "+", NULL)) {
-                return 0;
-            }
-        } else {
-            if (brace_low == 0) {
-                if (!process(sp, "?", NULL)) {
-                    return 0;
-                }
-                --brace_high;
-            }
-
-            for (int i = 1; i < brace_low; ++i) {
-                if (!process(sp, last, brace_start)) {
-                    return 0;
-                }
-            }
-
-            for (int i = brace_low; i < brace_high; ++i) {
-                if (!process(sp, last, brace_start)) {
-                    return 0;
-                }
-                if (!process(sp, "?", NULL)) {
-                    return 0;
-                }
-            }
-        }
-
-        return 1;
+        return tokenise_repeat(sp, sp->brace_low < 1 ? 0 : sp->brace_low, sp->brace_high);
     }
 
     if (!isdigit(v)) {
         return 0;
     }
 
-
     if (sp->brace_high == -1) {
         sp->brace_high = 0;
     }
 
     sp->brace_high = (sp->brace_high * 10) + (v - '0');
-    return 1;
+    return sp->brace_high <= REPEAT_MAX;
 }
 
 static int tokenise_cclass_start(struct tokeniser *sp, char const **pattern) {
@@ -681,8 +996,8 @@ static int attempt_cclass_expr(struct tokeniser *sp, char const **pattern) {
                     } else {
                         if (fn->fn(i)) {
                             if (sp->opts & OPT_I) {
-                                BITSET(sp->cclass_atom, tolower(i));
-                                BITSET(sp->cclass_atom, toupper(i));
+                                BITSET(sp->cclass_atom, (unsigned char)tolower(i));
+                                BITSET(sp->cclass_atom, (unsigned char)toupper(i));
                             } else {
                                 BITSET(sp->cclass_atom, i);
                             }
@@ -707,6 +1022,23 @@ static int tokenise_cclass_mid(struct tokeniser *sp, char const **pattern) {
     case ']':
         sp->state = CCLASS_POST;
 
+        if (sp->cclass_unicode) {
+            if (sp->cclass_binary) {
+                return 0;
+            }
+
+            for (int i = 0; i < 256; ++i) {
+                if (BITTEST(sp->cclass_atom, i)) {
+                    codepoints_add(sp->arena, &sp->cclass_codepoints, i, i);
+                }
+            }
+            codepoints_normalise(&sp->cclass_codepoints);
+            if (sp->cclass_negated) {
+                codepoints_negate(sp->arena, &sp->cclass_codepoints);
+            }
+            break;
+        }
+
         if (sp->cclass_negated) {
             for (int i = 0; i < BITNSLOTS(256); ++i) {
                 sp->cclass_atom[i] = ~sp->cclass_atom[i];
@@ -733,7 +1065,7 @@ static int tokenise_cclass_mid(struct tokeniser *sp, char const **pattern) {
         break;
 
     case '-':
-        if (!sp->cclass_last) {
+        if (sp->cclass_last < 0) {
             sp->cclass_last = **pattern;
             BITSET(sp->cclass_atom, sp->cclass_last);
         } else {
@@ -743,43 +1075,84 @@ static int tokenise_cclass_mid(struct tokeniser *sp, char const **pattern) {
 
     default:
         if (strncmp(*pattern, "[:", 2) == 0) {
+            sp->cclass_last = -1;
             return attempt_cclass_expr(sp, pattern);
         }
 
-        sp->cclass_last = **pattern;
-        if (sp->opts & OPT_I) {
-            BITSET(sp->cclass_atom, tolower(**pattern));
-            BITSET(sp->cclass_atom, toupper(**pattern));
+        sp->cclass_last = utf8_decode(pattern);
+        if (sp->cclass_last >= 0) {
+            sp->cclass_unicode = 1;
         } else {
-            BITSET(sp->cclass_atom, **pattern);
+            sp->cclass_last = (unsigned char)**pattern;
         }
+        cclass_add(sp, sp->cclass_last, sp->cclass_last);
         break;
     }
 
     return 1;
 }
 
+static int tokenise_cclass_escape(struct tokeniser *sp, char const **pattern) {
+    sp->state = CCLASS_MID;
+
+    if (**pattern == 'p' || **pattern == 'P') {
+        sp->cclass_unicode = 1;
+        sp->cclass_last = -1;
+        return process_category(sp->arena, pattern, &sp->cclass_codepoints);
+    }
+
+    if (**pattern == 'u') {
+        sp->cclass_unicode = 1;
+        sp->cclass_last = process_codepoint(pattern);
+        if (sp->cclass_last < 0) {
+            return 0;
+        }
+    } else {
+        sp->cclass_last = process_escape(pattern);
+    }
+
+    cclass_add(sp, sp->cclass_last, sp->cclass_last);
+    return 1;
+}
+
 static int tokenise_cclass_range(struct tokeniser *sp, char const **pattern) {
     if (**pattern == ']') {
-        BITSET(sp->cclass_atom, **pattern);
+        BITSET(sp->cclass_atom, '-');
         return tokenise_cclass_mid(sp, pattern);
     }
 
-    for (int i = sp->cclass_last; i <= **pattern; ++i) {
-        if (sp->opts & OPT_I) {
-            BITSET(sp->cclass_atom, tolower(i));
-            BITSET(sp->cclass_atom, toupper(i));
+    int last;
+    if (**pattern == '\\') {
+        ++*pattern;
+        if (**pattern == 'u') {
+            sp->cclass_unicode = 1;
+            last = process_codepoint(pattern);
+        } else if (**pattern && **pattern != 'p' && **pattern != 'P') {
+            last = process_escape(pattern);
         } else {
-            BITSET(sp->cclass_atom, i);
+            last = -1;
+        }
+
+        if (last < 0) {
+            return 0;
         }
+    } else if ((last = utf8_decode(pattern)) >= 0) {
+        sp->cclass_unicode = 1;
+    } else {
+        last = (unsigned char)**pattern;
     }
 
-    sp->cclass_last = 0;
+    cclass_add(sp, sp->cclass_last, last);
+    sp->cclass_last = -1;
     sp->state = CCLASS_MID;
     return 1;
 }
 
 static int tokenise_cclass_post(struct tokeniser *sp, char const **pattern) {
+    if (sp->cclass_unicode && (strncmp(*pattern, "{-}", 3) == 0 || strncmp(*pattern, "{+}", 3) == 0)) {
+        return 0;
+    }
+
     if (strncmp(*pattern, "{-}", 3) == 0) {
         *pattern += 2;
         sp->state = BRACE_CCLASS_SUBTRACT;
@@ -800,10 +1173,14 @@ static int tokenise_cclass_post(struct tokeniser *sp, char const **pattern) {
 static void cclass_post_cleanup(struct tokeniser *sp) {
     if (sp->natom > 1) {
         --sp->natom;
-        token_append(&sp->write, TYPE_CONCAT);
+        token_append(sp->arena, &sp->write, TYPE_CONCAT);
     }
 
-    token_append_atom(&sp->write, sp->cclass_atom);
+    if (sp->cclass_unicode) {
+        token_append_utf8(sp->arena, &sp->write, &sp->cclass_codepoints);
+    } else {
+        token_append_atom(sp->arena, &sp->write, sp->cclass_atom);
+    }
     ++sp->natom;
     sp->state = DEFAULT;
 }
@@ -0,0 +1,66 @@
+"""Write unicode.c, the code point ranges of each Unicode general category,
+from the Unicode database Python was built with:
+
+    python3 unicode.py > unicode.c
+"""
+import sys
+import unicodedata
+
+
+def categories():
+    """Return each category's ranges, leaving out unassigned code points and
+    surrogates, which UTF-8 can't hold."""
+    ranges = {}
+    for cp in range(0x110000):
+        category = unicodedata.category(chr(cp))
+        if category in ('Cn', 'Cs'):
+            continue
+        runs = ranges.setdefault(category, [])
+        if runs and runs[-1][1] == cp - 1:
+            runs[-1][1] = cp
+        else:
+            runs.append([cp, cp])
+    return ranges
+
+
+def main():
+    ranges = categories()
+    out = sys.stdout
+
+    out.write("#ifndef SONAVARA_UNICODE_INCLUDED\n")
+    out.write("#define SONAVARA_UNICODE_INCLUDED\n\n")
+    out.write("/* Generated by unicode.py from Unicode {}; don't edit.\n".format(unicodedata.unidata_version))
+    out.write(" *\n")
+    out.write(" * unicode_categories gives, for each general category, the n ranges of\n")
+    out.write(" * unicode_ranges from from that it covers, sorted.  Unassigned code points\n")
+    out.write(" * (Cn) and surrogates (Cs) aren't in any. */\n\n")
+
+    out.write("struct unicode_category {\n")
+    out.write("    char const *name;\n")
+    out.write("    int from;\n")
+    out.write("    int n;\n")
+    out.write("};\n\n")
+
+    out.write("static int const unicode_ranges[][2] = {\n")
+    index = []
+    total = 0
+    for name in sorted(ranges):
+        runs = ranges[name]
+        index.append((name, total, len(runs)))
+        total += len(runs)
+        for i in range(0, len(runs), 6):
+            out.write("    {}\n".format(" ".join("{{0x{:x}, 0x{:x}}},".format(lo, hi) for lo, hi in runs[i:i + 6])))
+    out.write("};\n\n")
+
+    out.write("static struct unicode_category const unicode_categories[] = {\n")
+    for name, start, n in index:
+        out.write("    {{\"{}\", {}, {}}},\n".format(name, start, n))
+    out.write("    {NULL, 0, 0},\n")
+    out.write("};\n\n")
+
+    out.write("#endif\n\n")
+    out.write("/* vim: set sw=4 et: */\n")
+
+
+if __name__ == '__main__':
+    main()
@@ -1,17 +1,24 @@
+import argparse
+import atexit
 import io
+import os
 import re
+import shlex
+import shutil
 import sys
+import tempfile
+from subprocess import PIPE
+from subprocess import STDOUT
+from subprocess import Popen
 from pkg_resources import resource_string
 
 
 __all__ = ['compile']
 
 
-def write_prelude(output, context):
+def write_prelude(output, context, match):
     sources = [
-        'tokeniser.c',
-        'nfa.c',
-        'engine.c',
+        'scan.c',
         'lexer.c',
     ]
 
@@ -26,40 +33,58 @@ def write_prelude(output, context):
     output.write("int lexer_lex(struct lexer *lexer{}) {{\n".format(", {} *context".format(context) if context else ""))
     output.write("""
 start:
-    if (*lexer->src == 0) {
+    if (lexer->src == lexer->end && !lexer_refill(lexer)) {
         return 0;
     }
 
-    for (struct lexer_rule *rule = current_rules; rule->pattern; ++rule) {
-        int len = regex_match_prefix(rule->re, lexer->src);
-        if (len <= 0) {
-            continue;
-        }
+    int rule_index, partial = 0;
+    size_t scanned;
+    int len = lexer_match(lexer, &rule_index, &partial, &scanned);
+    if (partial && lexer_refill(lexer)) {
+        lexer_count(lexer, -1, 0, scanned);
+        goto start;
+    }
 
-        lexer->src += len;
-        if (!rule->action) {
-            goto start;
-        }
+    lexer_count(lexer, len > 0 ? rule_index : -1, len, scanned);
 
-        char *match = strndup(lexer->src - len, len);
-        int skip = 0;
-""")
-    output.write("int token = rule->action(match, {}, &skip);\n".format("context" if context else "NULL"))
-    output.write("""
-        free(match);
+    if (len <= 0) {
+        return -1;
+    }
 
-        if (skip) {
-            goto start;
-        }
+    struct lexer_rule const *rule = &lexer->mode->rules[rule_index];
 
-        return token;
+    lexer->src += len;
+    if (!rule->action) {
+        goto start;
     }
 
-    return -1;
+    int skip = 0;
+""")
+    if match == 'span':
+        output.write("    int token = rule->action(lexer->src - len, len, {}, &skip, lexer);\n".format("context" if context else "NULL"))
+    else:
+        output.write("    char *match = strndup(lexer->src - len, len);\n")
+        output.write("    int token = rule->action(match, {}, &skip, lexer);\n".format("context" if context else "NULL"))
+        output.write("    free(match);\n")
+    output.write("""
+    if (skip) {
+        goto start;
+    }
+
+    return token;
 }
     """)
 
     output.write("\n")
+    output.write("#ifdef SONAVARA_INCREMENTAL\n")
+    output.write("static int lexer_lex_any(struct lexer *lexer, void *context) {\n")
+    if context:
+        output.write("    return lexer_lex(lexer, context);\n")
+    else:
+        output.write("    (void)context;\n")
+        output.write("    return lexer_lex(lexer);\n")
+    output.write("}\n")
+    output.write("#endif\n")
 
 
 class Parser:
@@ -88,6 +113,14 @@ class Parser:
 
             if key == 'context':
                 self.result['context'] = value
+            elif key == 'munch':
+                if value not in ('first', 'longest'):
+                    raise ValueError("munch must be first or longest, not {}".format(repr(value)))
+                self.result['munch'] = value
+            elif key == 'match':
+                if value not in ('copy', 'span'):
+                    raise ValueError("match must be copy or span, not {}".format(repr(value)))
+                self.result['match'] = value
             else:
                 raise ValueError(key)
             return
@@ -170,11 +203,198 @@ escape_cstr.subs = [
 ]
 
 
-def write_rules(fns, context, output, mode_name):
+def automaton_tool():
+    """Build the helper that compiles patterns to DFAs, once per process."""
+    if automaton_tool.path:
+        return automaton_tool.path
+
+    directory = tempfile.mkdtemp(prefix='sonavara')
+    atexit.register(shutil.rmtree, directory, True)
+
+    for filename in automaton_tool.sources:
+        with open(os.path.join(directory, filename), 'wb') as f:
+            f.write(resource_string('sonavara.c', filename))
+
+    path = os.path.join(directory, 'generator')
+    cc = shlex.split(os.environ.get('CC', 'cc'))
+    p = Popen(cc + ['-O2', '-o', path, os.path.join(directory, 'generator.c')], stdout=PIPE, stderr=STDOUT)
+    out, _ = p.communicate()
+    if p.returncode != 0:
+        raise RuntimeError("Could not build pattern compiler:\n{}".format(out.decode('utf8', 'replace')))
+
+    automaton_tool.path = path
+    return path
+automaton_tool.path = None
+automaton_tool.sources = [
+    'arena.c',
+    'unicode.c',
+    'tokeniser.c',
+    'nfa.c',
+    'scan.c',
+    'engine.c',
+    'generator.c',
+]
+
+
+def build_dfa(patterns, munch):
+    """Compile a mode's patterns to one minimal DFA, as the byte class of
+    each byte, a list of (accept, transitions) rows indexed by class, and the
+    number of states it had before it was minimised."""
+    if not patterns:
+        return [0] * 256, [(0, [0]), (0, [0])], 2
+
+    p = Popen([automaton_tool()], stdin=PIPE, stdout=PIPE)
+    out, _ = p.communicate("rules {} {}\n{}".format(
+        len(patterns), munch, "".join(pattern + "\n" for pattern in patterns)).encode('utf8'))
+    lines = out.decode('utf8').splitlines()
+
+    error = re.match(r'^error (\d+)$', lines[0]) if lines else None
+    if error:
+        raise ValueError("Could not compile pattern {}".format(repr(patterns[int(error.group(1))])))
+
+    if p.returncode != 0 or not lines:
+        raise ValueError("Pattern compilation failed")
+
+    header = re.match(r'^dfa (\d+) (\d+) (\d+)$', lines[0])
+    nstates = int(header.group(1))
+    classes = [int(v) for v in lines[1].split()]
+    dfa = []
+    for line in lines[2:nstates + 2]:
+        row = [int(v) for v in line.split()]
+        dfa.append((row[0], row[1:]))
+
+    return classes, dfa, int(header.group(3))
+
+
+def table_size(nstates, nclasses):
+    """Return the bytes a DFA takes as lexer_classes, lexer_dfa and
+    lexer_accept tables."""
+    return 256 + 2 * nstates * nclasses + 2 * nstates
+
+
+def dfa_loops(classes, dfa):
+    """Return, for each state, the scan.c byte set it loops on itself for, or
+    None if it doesn't."""
+    loops = [None]
+    for state in range(1, len(dfa)):
+        accept, transitions = dfa[state]
+        loop = [0] * 32
+        for c in range(256):
+            if transitions[classes[c]] == state:
+                loop[(c & 15) + (16 if c & 128 else 0)] |= 1 << ((c >> 4) & 7)
+        loops.append(loop if any(loop) else None)
+    return loops
+
+
+def write_loops(loops, output, suffix):
+    output.write("static unsigned char const lexer_loops{}[][32] = {{\n".format(suffix))
+    for loop in loops:
+        if loop:
+            output.write("    {{{}}},\n".format(",".join(str(b) for b in loop)))
+    if not any(loops):
+        output.write("    {0},\n")
+    output.write("};\n")
+
+
+def write_dfa(classes, dfa, output, suffix):
+    output.write("static unsigned char const lexer_classes{}[256] = {{{}}};\n".format(
+        suffix, ",".join(str(c) for c in classes)))
+
+    output.write("static unsigned short const lexer_dfa{}[] = {{\n".format(suffix))
+    for accept, transitions in dfa:
+        output.write("    {},\n".format(",".join(str(t) for t in transitions)))
+    output.write("};\n")
+
+    output.write("static unsigned short const lexer_accept{}[] = {{{}}};\n".format(
+        suffix, ",".join(str(accept) for accept, transitions in dfa)))
+
+    loops = dfa_loops(classes, dfa)
+    write_loops(loops, output, suffix)
+
+    index = 0
+    loop = []
+    for state_loop in loops:
+        if state_loop:
+            index += 1
+        loop.append(index if state_loop else 0)
+    output.write("static unsigned short const lexer_loop{}[] = {{{}}};\n".format(
+        suffix, ",".join(str(i) for i in loop)))
+
+
+def c_byte(c):
+    ch = chr(c)
+    if c < 128 and (ch.isalnum() or ch in " !#$%&()*+,-./:;<=>?@[]^_`{|}~"):
+        return "'{}'".format(ch)
+    return str(c)
+
+
+def write_scanner(classes, dfa, output, suffix):
+    """Write the DFA as a function with a label per state, switching on the
+    next byte."""
+    loops = dfa_loops(classes, dfa)
+    write_loops(loops, output, suffix)
+
+    output.write("static int lexer_scan{}(char const *s, char const *end, int *rule, int *partial, size_t *scanned) {{\n".format(suffix))
+    output.write("    char const *start = s;\n")
+    output.write("    int longest_match = -1;\n")
+
+    targeted = set(t for accept, transitions in dfa for t in transitions)
+
+    for state in range(1, len(dfa)):
+        accept, transitions = dfa[state]
+        output.write("\n")
+        if state in targeted:
+            output.write("state_{}:\n".format(state))
+        if loops[state]:
+            loop = "lexer_loops{}[{}]".format(suffix, sum(1 for loop in loops[:state] if loop))
+            output.write("    if (s < end && scan_set_contains({}, (unsigned char)*s)) {{\n".format(loop))
+            output.write("        s = scan_run({}, s + 1, end);\n".format(loop))
+            output.write("    }\n")
+        if accept:
+            output.write("    longest_match = s - start;\n")
+            output.write("    *rule = {};\n".format(accept - 1))
+
+        cases = {}
+        for c in range(256):
+            if transitions[classes[c]]:
+                cases.setdefault(transitions[classes[c]], []).append(c)
+
+        if not cases:
+            output.write("    *scanned = s - start;\n")
+            output.write("    return longest_match;\n")
+            continue
+
+        output.write("    if (s == end) {\n")
+        output.write("        *partial = 1;\n")
+        output.write("        *scanned = s - start;\n")
+        output.write("        return longest_match;\n")
+        output.write("    }\n")
+        output.write("    switch ((unsigned char)*s++) {\n")
+        for target, bytes in sorted(cases.items()):
+            for i in range(0, len(bytes), 8):
+                output.write("    {}\n".format(" ".join("case {}:".format(c_byte(c)) for c in bytes[i:i + 8])))
+            output.write("        goto state_{};\n".format(target))
+        if sum(len(bytes) for bytes in cases.values()) < 256:
+            output.write("    default:\n")
+            output.write("        *scanned = s - start;\n")
+            output.write("        return longest_match;\n")
+        output.write("    }\n")
+
+    output.write("}\n")
+
+
+def write_rules(fns, context, munch, match, style, output, mode_name, stats=None, built=None):
+    """Write a mode's actions, rules and DFA.  built maps the patterns and
+    munch of each mode already written to its suffix and DFA summary: a mode
+    with the same patterns as one of them reuses its DFA."""
+    suffix = "_{}".format(mode_name) if mode_name else ""
+
     for i, (pattern, body) in enumerate(fns):
         output.write("#pragma GCC diagnostic push\n")
         output.write("#pragma GCC diagnostic ignored \"-Wunused-variable\"\n")
-        output.write("static int lexer_fn_{}{}(char *match, void *_context, int *_skip) {{\n".format("{}_".format(mode_name) if mode_name else "", i))
+        output.write("static int lexer_fn_{}{}({}, void *_context, int *_skip, struct lexer *_lexer) {{\n".format(
+            "{}_".format(mode_name) if mode_name else "", i,
+            "char const *match, size_t match_len" if match == 'span' else "char *match"))
         if context:
             output.write("    {} *context = _context;\n".format(context))
         output.write(body)
@@ -184,34 +404,70 @@ def write_rules(fns, context, output, mode_name):
         output.write("}\n")
         output.write("#pragma GCC diagnostic pop\n")
 
-    output.write("struct lexer_rule rules{}[] = {{\n".format("_{}".format(mode_name) if mode_name else ""))
+    output.write("static struct lexer_rule const rules{}[] = {{\n".format(suffix))
     for i, (pattern, body) in enumerate(fns):
         output.write("    {{\"{}\", lexer_fn_{}{}}},\n".format(escape_cstr(pattern), "{}_".format(mode_name) if mode_name else "", i))
 
     output.write("    {NULL, NULL},\n")
     output.write("};\n")
 
+    key = (tuple(pattern for pattern, body in fns), munch)
+    if built is not None and key in built:
+        dfa_suffix, nclasses, summary = built[key]
+        output.write("/* lexer_mode{}: {}; shared with lexer_mode{}. */\n".format(suffix, summary, dfa_suffix))
+    else:
+        classes, dfa, unminimised = build_dfa(list(key[0]), munch)
+        dfa_suffix, nclasses = suffix, len(dfa[0][1])
+        summary = "{} DFA states, {} once minimised; {} byte classes; tables of {} bytes, {} once minimised".format(
+            unminimised, len(dfa), nclasses, table_size(unminimised, nclasses), table_size(len(dfa), nclasses))
+        output.write("/* lexer_mode{}: {}. */\n".format(suffix, summary))
+        if built is not None:
+            built[key] = (suffix, nclasses, summary)
+
+        if style == 'goto':
+            write_scanner(classes, dfa, output, suffix)
+        else:
+            write_dfa(classes, dfa, output, suffix)
+
+    if stats:
+        stats.write("{}: {}\n".format(mode_name or "default mode", summary))
+
+    name = "\"{}\"".format(mode_name) if mode_name else "NULL"
+    if style == 'goto':
+        output.write("struct lexer_mode const lexer_mode{} = {{lexer_scan{}, rules{}, {}}};\n".format(
+            suffix, dfa_suffix, suffix, name))
+    else:
+        output.write("struct lexer_mode const lexer_mode{} = {{lexer_classes{}, {}, lexer_dfa{}, lexer_accept{}, lexer_loop{}, lexer_loops{}, rules{}, {}}};\n".format(
+            suffix, dfa_suffix, nclasses, dfa_suffix, dfa_suffix, dfa_suffix, dfa_suffix, suffix, name))
+
+
+def compile(input, output=None, style='table', stats=None):
+    """Generate a lexer from input.  style is 'table' for table-driven DFAs,
+    or 'goto' for DFAs emitted as direct code.  If stats is given, a line of
+    DFA sizes for each mode is written to it."""
+    if style not in ('table', 'goto'):
+        raise ValueError(style)
 
-def compile(input, output=None):
     parsed = Parser().parse(input)
     output.write(parsed['raw'])
-    write_prelude(output, parsed.get('context'))
+    if style == 'goto':
+        output.write("#define SONAVARA_DIRECT_CODE\n")
+    match = parsed.get('match', 'copy')
+    if match == 'span':
+        output.write("#define SONAVARA_MATCH_SPAN\n")
+    write_prelude(output, parsed.get('context'), match)
 
     for name in parsed['modes'].keys():
-        output.write("extern struct lexer_rule rules_{}[];\n".format(name))
+        output.write("extern struct lexer_mode const lexer_mode_{};\n".format(name))
 
-    write_rules(parsed['fns'], parsed.get('context'), output, None)
+    munch = parsed.get('munch', 'first')
+    built = {}
+    write_rules(parsed['fns'], parsed.get('context'), munch, match, style, output, None, stats, built)
     for name, fns in parsed['modes'].items():
-        write_rules(fns, parsed.get('context'), output, name)
+        write_rules(fns, parsed.get('context'), munch, match, style, output, name, stats, built)
 
-    output.write("struct lexer_rule *current_rules = rules;\n")
-
-    output.write("static int lexer_init_all() {\n")
-    output.write("    if (!lexer_init(rules)) { return 0; }\n")
-    for name in parsed['modes'].keys():
-        output.write("    if (!lexer_init(rules_{})) {{ return 0; }}\n".format(name))
-    output.write("    return 1;\n")
-    output.write("}")
+    modes = ["&lexer_mode"] + ["&lexer_mode_{}".format(name) for name in parsed['modes']]
+    output.write("struct lexer_mode const *const lexer_modes[] = {{{}, NULL}};\n".format(", ".join(modes)))
 
     if isinstance(output, io.StringIO):
         v = output.getvalue()
@@ -220,7 +476,14 @@ def compile(input, output=None):
 
 
 def main():
-    compile(sys.stdin.read(), sys.stdout)
+    parser = argparse.ArgumentParser(description="Generate a C lexer from the definition on stdin.")
+    parser.add_argument('--style', choices=['table', 'goto'], default='table',
+                        help="emit DFAs as transition tables (default) or as direct goto-based code")
+    parser.add_argument('--stats', action='store_true',
+                        help="report each mode's DFA size before and after minimisation on stderr")
+    args = parser.parse_args()
+
+    compile(sys.stdin.read(), sys.stdout, style=args.style, stats=sys.stderr if args.stats else None)
 
 
 if __name__ == '__main__':
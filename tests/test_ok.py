@@ -1,17 +1,23 @@
 import codecs
+import io
 import os
 import tempfile
 from subprocess import PIPE
 from subprocess import Popen
 from subprocess import TimeoutExpired
 
+import pytest
+
 from sonavara.main import compile
 
 
 class SonavaraLexer:
-    def __init__(self, *, code, context=False):
+    def __init__(self, *, code, context=False, style='table', cflags=(), path=False):
         self.code = code
         self.context = context
+        self.style = style
+        self.cflags = list(cflags)
+        self.path = path
 
     def __enter__(self):
         self.compile()
@@ -25,12 +31,15 @@ class SonavaraLexer:
         self.name = name
         os.close(f)
 
-        p = Popen(['gcc', '-DSONAVARA_INCLUDE_FILE', '-DSONAVARA_NO_SELF_CHAIN', '-o', self.name, '-Wall', '-g', '-x', 'c', '-'], stdin=PIPE)
-        compile(self.code, codecs.getwriter('utf8')(p.stdin))
+        p = Popen(['gcc', '-DSONAVARA_INCLUDE_FILE', '-DSONAVARA_NO_SELF_CHAIN'] + self.cflags + ['-o', self.name, '-Wall', '-g', '-x', 'c', '-'], stdin=PIPE)
+        compile(self.code, codecs.getwriter('utf8')(p.stdin), style=self.style)
         p.stdin.write(b"""
             int main(int argc, char **argv) {
-                struct lexer *lexer = lexer_start_file(stdin);
 """)
+        if self.path:
+            p.stdin.write(b"struct lexer *lexer = lexer_start_path(argv[1]);\n")
+        else:
+            p.stdin.write(b"struct lexer *lexer = lexer_start_file(stdin);\n")
         if self.context:
             p.stdin.write(b"""struct lexer_context context;\n""")
 
@@ -76,9 +85,18 @@ class SonavaraLexer:
                 pass
 
     def test(self, input, tokens, error=False):
-        p = Popen([self.name], stdin=PIPE, stdout=PIPE, stderr=PIPE)
+        if self.path:
+            with tempfile.NamedTemporaryFile() as f:
+                f.write(input.encode('utf8'))
+                f.flush()
+                self.run([self.name, f.name], b"", tokens, error)
+        else:
+            self.run([self.name], input.encode('utf8'), tokens, error)
+
+    def run(self, args, input, tokens, error):
+        p = Popen(args, stdin=PIPE, stdout=PIPE, stderr=PIPE)
         try:
-            out, errs = p.communicate(input.encode('utf8'), timeout=10)
+            out, errs = p.communicate(input, timeout=10)
         except TimeoutExpired:
             p.kill()
             out, errs = p.communicate()
@@ -91,6 +109,20 @@ class SonavaraLexer:
         assert errs == b""
 
 
+def compile_and_run(source, cflags, timeout=10):
+    """Compile source, a lexer with its own main, with cflags, run it and
+    return what it writes."""
+    with tempfile.TemporaryDirectory() as directory:
+        name = os.path.join(directory, 'lexer')
+        p = Popen(['gcc'] + cflags + ['-o', name, '-x', 'c', '-'], stdin=PIPE)
+        p.communicate(source.encode('utf8'))
+        assert p.returncode == 0
+
+        p = Popen([name], stdout=PIPE)
+        out, _ = p.communicate(timeout=timeout)
+        return out
+
+
 def test_base():
     with SonavaraLexer(code="""
 abc
@@ -160,3 +192,540 @@ def test_mode():
     return 2;
 """) as sv:
         sv.test('"abc"', [2, 1])
+
+
+def test_invalid_pattern():
+    with pytest.raises(ValueError):
+        compile("""
+(abc
+    return 1;
+""", io.StringIO())
+
+
+def test_first_rule_wins():
+    with SonavaraLexer(code="""
+if
+    return 1;
+
+[a-z]+
+    return 2;
+
+[ ]+
+""") as sv:
+        sv.test("if", [1])
+        sv.test("iffy", [1, 2])
+        sv.test("fi if", [2, 1])
+
+
+def test_longest_munch():
+    with SonavaraLexer(code="""
+*set munch = longest
+
+if
+    return 1;
+
+[a-z]+
+    return 2;
+
+[ ]+
+""") as sv:
+        sv.test("if", [1])
+        sv.test("iffy", [2])
+        sv.test("fi if", [2, 1])
+
+
+def test_goto_style():
+    with SonavaraLexer(style='goto', code="""
+"
+    BEGIN(string);
+
+if
+    return 3;
+
+[a-z]+
+    return 4;
+
+[ ]+
+
+*mode string
+
+"
+    END();
+    return 1;
+
+[^"]+
+    return 2;
+""") as sv:
+        sv.test('"abc"', [2, 1])
+        sv.test('if iffy ""', [3, 3, 4, 1])
+        sv.test('if "x" y', [3, 2, 1, 4])
+        sv.test('if !', [3], True)
+
+
+def test_threads():
+    """Lexers on different threads switch modes independently."""
+    source = compile("""
+"
+    BEGIN(string);
+    return 1;
+
+[a-z]+
+    return 2;
+
+[ ]+
+
+*mode string
+
+"
+    END();
+    return 3;
+
+[^"]+
+    return 4;
+""", io.StringIO())
+
+    main = """
+#include <pthread.h>
+#include <stdio.h>
+
+static void *run(void *arg) {
+    long reps = (long)arg, sum = 0, count = 0;
+    char *src = malloc(reps * 9 + 1), *p = src;
+    for (long i = 0; i < reps; ++i) {
+        p += sprintf(p, "ab \\"x y\\" ");
+    }
+
+    struct lexer *lexer = lexer_start_str(src);
+    for (int t; (t = lexer_lex(lexer)) > 0; ++count) {
+        sum += t;
+    }
+    lexer_free(lexer);
+    free(src);
+
+    return (void *)(long)(sum == 10 * reps && count == 4 * reps);
+}
+
+int main(void) {
+    pthread_t threads[8];
+    for (long i = 0; i < 8; ++i) {
+        pthread_create(&threads[i], NULL, run, (void *)(2000 + i));
+    }
+
+    int ok = 1;
+    for (int i = 0; i < 8; ++i) {
+        void *result;
+        pthread_join(threads[i], &result);
+        ok &= result != NULL;
+    }
+
+    puts(ok ? "ok" : "mixed up");
+    return !ok;
+}
+"""
+
+    out = compile_and_run(source + main, ['-DSONAVARA_NO_SELF_CHAIN', '-Wall', '-pthread'])
+    assert out == b"ok\n"
+
+
+def test_parallel():
+    """Lexing ahead on threads gives the same tokens as lexing alone."""
+    source = compile("""
+"
+    BEGIN(string);
+    return 1;
+
+[a-z]+
+    return 2;
+
+[0-9]+
+    return 3;
+
+[ \\n]+
+
+*mode string
+
+"
+    END();
+    return 4;
+
+[^"\\\\]+|\\\\.
+    return 5;
+""", io.StringIO())
+
+    main = """
+#include <stdio.h>
+
+static unsigned long run(char const *src, size_t len, int threads) {
+    unsigned long hash = 0;
+    struct lexer *lexer = lexer_start_mem(src, len);
+    if (threads && !lexer_parallel(lexer, threads)) {
+        return 0;
+    }
+
+    int t;
+    while ((t = lexer_lex(lexer)) > 0) {
+        hash = hash * 31 + t;
+        hash = hash * 31 + (lexer->src - src);
+    }
+    lexer_free(lexer);
+
+    return hash * 31 + t;
+}
+
+int main(void) {
+    static char const *words[] = {"ab ", "x", "12", "\\"q z\\" ", "\\"\\\\\\"a\\" ", "\\n", "7 "};
+    size_t len = 200000;
+    char *src = malloc(len), *p = src;
+    unsigned seed = 1;
+    while (p < src + len - 8) {
+        seed = seed * 1103515245 + 12345;
+        char const *word = words[(seed >> 16) % 7];
+        memcpy(p, word, strlen(word));
+        p += strlen(word);
+    }
+
+    int ok = 1;
+    unsigned long alone = run(src, p - src, 0);
+    for (int threads = 1; threads <= 8; threads *= 2) {
+        ok &= run(src, p - src, threads) == alone;
+    }
+
+    /* An unterminated string ends with an error either way. */
+    memcpy(p, "\\"ab", 3);
+    ok &= run(src, p + 3 - src, 4) == run(src, p + 3 - src, 0);
+    free(src);
+
+    puts(ok ? "ok" : "different");
+    return !ok;
+}
+"""
+
+    out = compile_and_run(source + main, ['-DSONAVARA_PARALLEL', '-DSONAVARA_CHUNK_SIZE=4096', '-Wall', '-pthread'])
+    assert out == b"ok\n"
+
+
+def test_incremental():
+    """Relexing after an edit gives the tokens lexing afresh would."""
+    source = compile("""
+"
+    BEGIN(string);
+    return 1;
+
+/\\*
+    BEGIN(comment);
+
+[a-z]+
+    return 2;
+
+[0-9]+(\\.[0-9]+)?
+    return 3;
+
+[ \\n]+
+
+*mode string
+
+"
+    END();
+    return 4;
+
+[^"]+
+    return 5;
+
+*mode comment
+
+\\*/
+    END();
+
+[^*]+|\\*
+""", io.StringIO())
+
+    main = """
+#include <stdio.h>
+
+static int same(struct lexer_lexemes const *a, struct lexer_lexemes const *b) {
+    return a->n == b->n && a->last == b->last &&
+        memcmp(a->tokens, b->tokens, sizeof(*a->tokens) * a->n) == 0;
+}
+
+int main(void) {
+    static char const *words[] = {"ab ", "x", "1.5 ", "12", "\\"q z\\" ", "/* c */", "/**/ ", "\\n", "7 "};
+    static char const *edits[] = {"", " ", "\\"", "/*", "*/", "9", ".", "q", "!"};
+    size_t cap = 1 << 12, len = 0;
+    char *src = malloc(cap + 16);
+    unsigned seed = 1;
+    while (len < cap - 16) {
+        seed = seed * 1103515245 + 12345;
+        char const *word = words[(seed >> 16) % 9];
+        memcpy(src + len, word, strlen(word));
+        len += strlen(word);
+    }
+
+    int ok = 1;
+    size_t relexed = 0;
+    struct lexer_lexemes *lexemes = lexer_lex_all(src, len, NULL);
+    size_t n = lexemes->n;
+    for (int i = 0; i < 1000 && ok; ++i) {
+        /* Each edit is undone by the next. */
+        static char saved[4];
+        static size_t offset, deleted, inserted;
+        char const *edit;
+        if (i % 2) {
+            edit = saved;
+            size_t t = deleted;
+            deleted = inserted;
+            inserted = t;
+        } else {
+            seed = seed * 1103515245 + 12345;
+            offset = (seed >> 8) % (len + 1);
+            deleted = (seed >> 4) % 4;
+            if (offset + deleted > len) {
+                deleted = len - offset;
+            }
+            edit = edits[(seed >> 16) % 9];
+            inserted = strlen(edit);
+            memcpy(saved, src + offset, deleted);
+        }
+
+        memmove(src + offset + inserted, src + offset + deleted, len - offset - deleted);
+        memcpy(src + offset, edit, inserted);
+        len = len - deleted + inserted;
+
+        lexer_relex(lexemes, src, len, offset, deleted, inserted, NULL);
+        relexed += lexemes->relexed;
+
+        struct lexer_lexemes *fresh = lexer_lex_all(src, len, NULL);
+        ok &= same(lexemes, fresh);
+        lexer_lexemes_free(fresh);
+    }
+    ok &= lexemes->n == n;
+
+    /* Most edits stay local, but an unbalanced quote relexes the rest. */
+    ok &= relexed < 1000 * n / 4;
+    lexer_lexemes_free(lexemes);
+
+    /* Deleting leading tokens relexes only up to where they fall back in
+     * step. */
+    len = 0;
+    while (len < 1000) {
+        memcpy(src + len, "ab 12 ", 6);
+        len += 6;
+    }
+    lexemes = lexer_lex_all(src, len, NULL);
+    memmove(src, src + 9, len - 9);
+    len -= 9;
+    lexer_relex(lexemes, src, len, 0, 9, 0, NULL);
+    struct lexer_lexemes *fresh = lexer_lex_all(src, len, NULL);
+    ok &= same(lexemes, fresh) && lexemes->relexed < 8;
+    lexer_lexemes_free(fresh);
+    lexer_lexemes_free(lexemes);
+    free(src);
+
+    puts(ok ? "ok" : "different");
+    return !ok;
+}
+"""
+
+    out = compile_and_run(source + main, ['-DSONAVARA_INCREMENTAL', '-Wall', '-Werror'], timeout=30)
+    assert out == b"ok\n"
+
+
+def test_minimised_dfa():
+    code = """
+ab*|cb*
+    return 1;
+
+[ ]+
+"""
+    stats = io.StringIO()
+    out = compile(code, io.StringIO(), stats=stats)
+    summary = "5 DFA states, 4 once minimised; 5 byte classes; tables of 316 bytes, 304 once minimised"
+    assert stats.getvalue() == "default mode: {}\n".format(summary)
+    assert "/* lexer_mode: {}. */".format(summary) in out
+
+    with SonavaraLexer(code=code) as sv:
+        sv.test("abbb cb a c", [1, 1, 1, 1])
+        sv.test("abbb b", [1], True)
+
+
+def test_shared_dfa():
+    """Modes with the same patterns share one DFA, whatever their actions."""
+    code = """
+"
+    BEGIN(string);
+
+@"
+    BEGIN(verbatim);
+
+*mode string
+
+"
+    END();
+    return 1;
+
+[^"]+
+    return 2;
+
+*mode verbatim
+
+"
+    END();
+    return 3;
+
+[^"]+
+    return 4;
+"""
+    for style in ('table', 'goto'):
+        out = compile(code, io.StringIO(), style=style)
+        assert "shared with lexer_mode_string. */" in out
+        assert "lexer_dfa_verbatim" not in out and "lexer_scan_verbatim" not in out
+
+    with SonavaraLexer(code=code) as sv:
+        sv.test('"ab"@"c\\d"""', [2, 1, 4, 3, 1])
+
+
+def test_match_span():
+    with SonavaraLexer(code="""
+*raw
+    #include <stdio.h>
+
+*set match = span
+
+[a-z]+
+    printf("%.*s %d\\n", (int)match_len, match, (int)match_len);
+    return 1;
+
+[ ]+
+""") as sv:
+        sv.test("abc", ["abc 3", 1])
+        sv.test("ab cde", ["ab 2", 1, "cde 3", 1])
+
+
+@pytest.mark.parametrize('style', ['table', 'goto'])
+def test_refill(style):
+    with SonavaraLexer(style=style, cflags=['-DSONAVARA_BUFFER_SIZE=4'], code="""
+*raw
+    #include <stdio.h>
+
+[a-z]+
+    printf("%s\\n", match);
+    return 1;
+
+[0-9]+
+    return 2;
+
+[ ]+
+""") as sv:
+        sv.test("ab cd", ["ab", 1, "cd", 1])
+        sv.test("abc defghijklm 123456789 n", ["abc", 1, "defghijklm", 1, 2, "n", 1])
+        sv.test("abcd 12x", ["abcd", 1, 2, "x", 1])
+        sv.test("ab !", ["ab", 1], True)
+
+
+@pytest.mark.parametrize('path', [False, True])
+def test_binary_input(path):
+    with SonavaraLexer(path=path, code="""
+*set match = span
+
+[a-z]+
+    return 1;
+
+\\0+
+    return 2;
+
+[ ]+
+""") as sv:
+        sv.test("ab\0\0cd \0", [1, 2, 1, 2])
+        sv.test("", [])
+        sv.test("ab\0!", [1, 2], True)
+
+
+@pytest.mark.parametrize('style', ['table', 'goto'])
+def test_unicode(style):
+    with SonavaraLexer(style=style, code="""
+\\p{L}[\\p{L}\\p{Nd}_]*
+    return 1;
+
+[\\u{2200}-\\u{22ff}]+
+    return 2;
+
+\\p{Zs}+
+""") as sv:
+        sv.test("héllo Привет x٣", [1, 1, 1])
+        sv.test("a∀b ∧∨", [1, 2, 1, 2])
+        sv.test("日本語\u3000ok", [1, 1])
+        sv.test("a €", [1], True)
+
+
+@pytest.mark.parametrize('style', ['table', 'goto'])
+def test_long_runs(style):
+    with SonavaraLexer(style=style, code="""
+[a-z_]+
+    return 1;
+
+"[^"]*"
+    return 2;
+
+[^ a-z_"]+
+    return 3;
+
+[ ]+
+""") as sv:
+        sv.test("a " + "b" * 100 + " " + "c_" * 40, [1, 1, 1])
+        sv.test('"' + "x y " * 50 + '" "" abc', [2, 2, 1])
+        sv.test("é" * 40 + " ab" + "é" * 17, [3, 1, 3])
+        sv.test("a" * 70 + "\"" + "x" * 40, [1], True)
+
+
+@pytest.mark.parametrize('style', ['table', 'goto'])
+def test_stats(style):
+    """With SONAVARA_STATS, the lexer counts tokens and bytes per rule."""
+    source = compile("""
+"
+    BEGIN(string);
+    return 1;
+
+[a-z]+
+    return 2;
+
+[0-9]+
+    return 3;
+
+[ ]+
+
+*mode string
+
+"
+    END();
+    return 4;
+
+[^"]+
+    return 5;
+""", io.StringIO(), style=style)
+
+    main = """
+#include <stdio.h>
+
+int main(void) {
+    struct lexer *lexer = lexer_start_str("ab 12 \\"x y\\" cd!");
+    while (lexer_lex(lexer) > 0) {
+    }
+    lexer_stats_write(lexer, stdout);
+    lexer_free(lexer);
+    return 0;
+}
+"""
+
+    out = compile_and_run(source + main, ['-DSONAVARA_STATS', '-Wall', '-Werror'])
+    # Tables read the byte after a " to find that the DFA died; code
+    # knows the state has no way out.
+    extra = 1 if style == 'table' else 0
+    assert out.decode('utf8') == """\
+default mode: 8 attempts; {} bytes read, {} wasted
+    rule 0: 1 tokens, 1 bytes: "
+    rule 1: 2 tokens, 4 bytes: [a-z]+
+    rule 2: 1 tokens, 2 bytes: [0-9]+
+    rule 3: 3 tokens, 3 bytes: [ ]+
+string: 2 attempts; {} bytes read, {} wasted
+    rule 0: 1 tokens, 1 bytes: "
+    rule 1: 1 tokens, 3 bytes: [^"]+
+""".format(17 + extra, 7 + extra, 5 + extra, 1 + extra)